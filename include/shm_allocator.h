@@ -0,0 +1,516 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_ALLOCATOR_H_
+#define __SHM_ALLOCATOR_H_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SHM_STL_NO_DPDK
+#include <rte_eal.h>
+#include <rte_malloc.h>
+#include <rte_memzone.h>
+#include <rte_lcore.h>
+#endif
+
+#include "shm_common.h"
+#include "shm_lock.h"
+
+__SHM_STL_BEGIN
+
+/*
+ * An allocator policy tells the containers how to get shared memory and which
+ * role the current process plays. It provides following static methods:
+ *
+ *  1. process_type    - SHM_PROC_PRIMARY, SHM_PROC_SECONDARY or SHM_PROC_INVALID
+ *  2. reserve         - Create a named shared memory block, called by the primary
+ *  3. lookup          - Find a named shared memory block, called by secondaries
+ *  4. zmalloc/free    - Allocate zeroed shared memory which every process can access
+ *                       by the same address
+ *  5. zmalloc_private/free_private - Allocate zeroed memory used by this process only
+ *
+ * A pointer stored in shared memory must be valid in every process, so all
+ * processes should map shared memory at the same address.
+ */
+
+/*
+ * A zone name must fit in size bytes with its terminator. A longer name is not
+ * truncated, or "HT_<name>" could be found by a lookup of "HT_<name>_SK".
+ */
+inline bool
+zone_name_valid(const char * name, size_t size) {
+    return name != NULL && name[0] != '\0' && strnlen(name, size) < size;
+}
+
+#ifndef SHM_STL_NO_DPDK
+
+/*
+ * @brief : Allocate from DPDK memzones and hugepage heap. EAL must be initialized.
+ * */
+struct dpdk_alloc {
+    static proc_type process_type(void) {
+        switch (rte_eal_process_type()) {
+            case RTE_PROC_PRIMARY:
+                return SHM_PROC_PRIMARY;
+            case RTE_PROC_SECONDARY:
+                return SHM_PROC_SECONDARY;
+            default:
+                return SHM_PROC_INVALID;
+        }
+    }
+
+    // A name longer than RTE_MEMZONE_NAMESIZE - 1 is rejected, EAL would truncate it
+    static void * reserve(const char * name, size_t size) {
+        if (!zone_name_valid(name, RTE_MEMZONE_NAMESIZE))
+            return NULL;
+
+        const struct rte_memzone * zone = rte_memzone_reserve(name, size, 0, RTE_MEMZONE_SIZE_HINT_ONLY);
+        return zone ? zone->addr : NULL;
+    }
+
+    static void * lookup(const char * name) {
+        if (!zone_name_valid(name, RTE_MEMZONE_NAMESIZE))
+            return NULL;
+
+        const struct rte_memzone * zone = rte_memzone_lookup(name);
+        return zone ? zone->addr : NULL;
+    }
+
+    static void * zmalloc(const char * name, size_t size, unsigned align) {
+        return rte_zmalloc(name, size, align);
+    }
+
+    static void free(void * ptr) {rte_free(ptr);}
+
+    // Private memory is allocated on the socket of current lcore
+    static void * zmalloc_private(const char * name, size_t size, unsigned align) {
+        return rte_zmalloc_socket(name, size, align, rte_socket_id());
+    }
+
+    static void free_private(void * ptr) {rte_free(ptr);}
+};
+
+#endif
+
+/*
+ * @brief : Allocate from a POSIX shared memory arena, no DPDK is required.
+ *
+ *          Every process calls posix_alloc::init() once before it creates or
+ *          attaches any container, just like rte_eal_init(). The primary creates
+ *          the arena, secondaries map it at the address chosen by the primary.
+ *
+ *          The arena is a file on hugetlbfs if hugepage_dir is mounted and has
+ *          enough free hugepages, otherwise it is a shm_open() object backed by
+ *          normal pages. (MAP_HUGETLB only applies to anonymous mappings, which
+ *          can not be shared by unrelated processes, so hugetlbfs is used.)
+ *
+ *          The arena is managed by a first-fit allocator, which is protected by a
+ *          spin lock in the arena header. Freed blocks are merged with their free
+ *          neighbours. All blocks are aligned to cache line, a larger alignment is
+ *          not supported.
+ *
+ *          Following is a chart to illustrate the arena:
+ *
+ *          base --> +--------+-------+-------+-----+-------+--------------------+
+ *                   | header | block | block | ... | block |       unused       |
+ *                   +--------+-------+-------+-----+-------+--------------------+
+ *                                                          ^
+ *                                                          used
+ * */
+class posix_alloc {
+    public:
+        static const size_t DEFAULT_ARENA_SIZE = 256UL << 20;
+        static const size_t HUGEPAGE_SIZE = 2UL << 20;
+        static const u_int32_t MAX_ZONES = 64;
+        static const u_int32_t NAME_SIZE = 32;
+
+        static bool init(const char * name, proc_type type, size_t size = DEFAULT_ARENA_SIZE,
+                         const char * hugepage_dir = "/dev/hugepages") {
+            local_state & local = state();
+            if (local.addr != NULL)
+                return false;
+
+            if (type == SHM_PROC_PRIMARY)
+                return create_arena(name, size, hugepage_dir);
+            else if (type == SHM_PROC_SECONDARY)
+                return attach_arena(name, hugepage_dir);
+            else
+                return false;
+        }
+
+        // Unmap the arena, the primary also removes it
+        static void fini(void) {
+            local_state & local = state();
+            if (local.addr == NULL)
+                return;
+
+            munmap(local.addr, local.size);
+            if (local.type == SHM_PROC_PRIMARY) {
+                if (local.hugepage)
+                    unlink(local.path);
+                else
+                    shm_unlink(local.path);
+            }
+
+            local.addr = NULL;
+            local.size = 0;
+            local.type = SHM_PROC_INVALID;
+        }
+
+        static proc_type process_type(void) {return state().type;}
+
+        // A name longer than NAME_SIZE - 1 is rejected
+        static void * reserve(const char * name, size_t size) {
+            arena * a = state().addr;
+            if (a == NULL || !zone_name_valid(name, NAME_SIZE))
+                return NULL;
+
+            a->lock.lock();
+
+            void * ptr = NULL;
+            if (find_zone(a, name) == NULL && a->zone_num < MAX_ZONES) {
+                ptr = alloc_block(a, size);
+                if (ptr) {
+                    zone * z = &a->zones[a->zone_num++];
+                    strcpy(z->name, name);
+                    z->offset = (char *)ptr - (char *)a;
+                }
+            }
+
+            a->lock.unlock();
+            return ptr;
+        }
+
+        static void * lookup(const char * name) {
+            arena * a = state().addr;
+            if (a == NULL || !zone_name_valid(name, NAME_SIZE))
+                return NULL;
+
+            a->lock.lock();
+            zone * z = find_zone(a, name);
+            void * ptr = z ? (char *)a + z->offset : NULL;
+            a->lock.unlock();
+
+            return ptr;
+        }
+
+        static void * zmalloc(const char * name, size_t size, unsigned align) {
+            (void)name;
+            (void)align;
+
+            arena * a = state().addr;
+            if (a == NULL)
+                return NULL;
+
+            a->lock.lock();
+            void * ptr = alloc_block(a, size);
+            a->lock.unlock();
+
+            return ptr;
+        }
+
+        static void free(void * ptr) {
+            arena * a = state().addr;
+            if (a == NULL || ptr == NULL)
+                return;
+
+            block * b = reinterpret_cast<block *>((char *)ptr - SHM_CACHE_LINE_SIZE);
+
+            a->lock.lock();
+            free_block(a, b);
+            a->lock.unlock();
+        }
+
+        static void * zmalloc_private(const char * name, size_t size, unsigned align) {
+            (void)name;
+
+            void * ptr = NULL;
+            if (align < SHM_CACHE_LINE_SIZE)
+                align = SHM_CACHE_LINE_SIZE;
+
+            if (posix_memalign(&ptr, align, size) != 0)
+                return NULL;
+
+            memset(ptr, 0, size);
+            return ptr;
+        }
+
+        static void free_private(void * ptr) {::free(ptr);}
+
+    private:
+        static const u_int64_t ARENA_MAGIC = 0x73686d5f73746c31ULL; // "shm_stl1"
+
+        struct zone {
+            char      name[NAME_SIZE];
+            u_int64_t offset;   // the offset of the zone from the arena base
+        };
+
+        // The header of a block, it takes a whole cache line to keep blocks aligned
+        struct block {
+            u_int64_t size;     // the size of this block including the header
+            u_int64_t next;     // the offset of the next free block, 0 is the end
+        };
+
+        struct arena {
+            u_int64_t magic;
+            u_int64_t base;     // every process maps the arena at this address
+            u_int64_t size;
+            u_int64_t used;     // the offset of the unused space
+            u_int64_t free_list;// the offset of the first free block, 0 means empty
+            spinlock  lock;
+            u_int32_t zone_num;
+            zone      zones[MAX_ZONES];
+        };
+
+        struct local_state {
+            arena *   addr;
+            size_t    size;
+            proc_type type;
+            bool      hugepage;
+            char      path[256];
+        };
+
+        // It is not static, so all translation units share the same state
+        static local_state & state(void) {
+            static local_state local = {NULL, 0, SHM_PROC_INVALID, false, {0}};
+            return local;
+        }
+
+        static zone * find_zone(arena * a, const char * name) {
+            for (u_int32_t i = 0; i < a->zone_num; ++i) {
+                if (strcmp(a->zones[i].name, name) == 0)
+                    return &a->zones[i];
+            }
+
+            return NULL;
+        }
+
+        // The caller should hold the arena lock
+        static void * alloc_block(arena * a, size_t size) {
+            u_int64_t need = SHM_CACHE_LINE_SIZE + align_size64(size, SHM_CACHE_LINE_SIZE);
+            block * b = NULL;
+
+            // First fit in free blocks, split it if the rest is large enough
+            u_int64_t * link = &a->free_list;
+            while (*link) {
+                block * curr = reinterpret_cast<block *>((char *)a + *link);
+                if (curr->size >= need) {
+                    if (curr->size - need >= 2 * SHM_CACHE_LINE_SIZE) {
+                        block * rest = reinterpret_cast<block *>((char *)curr + need);
+                        rest->size = curr->size - need;
+                        rest->next = curr->next;
+                        *link = (char *)rest - (char *)a;
+                        curr->size = need;
+                    } else {
+                        *link = curr->next;
+                    }
+
+                    b = curr;
+                    break;
+                }
+
+                link = &curr->next;
+            }
+
+            if (b == NULL) {
+                if (a->used + need > a->size)
+                    return NULL;
+
+                b = reinterpret_cast<block *>((char *)a + a->used);
+                b->size = need;
+                a->used += need;
+            }
+
+            b->next = 0;
+            void * ptr = (char *)b + SHM_CACHE_LINE_SIZE;
+            memset(ptr, 0, b->size - SHM_CACHE_LINE_SIZE);
+            return ptr;
+        }
+
+        /*
+         * @brief : Put a block back to the free list, which is sorted by offset so
+         *          the block is merged with its free neighbours. A free block at the
+         *          end of used space is returned to the unused space. The caller
+         *          should hold the arena lock.
+         * */
+        static void free_block(arena * a, block * b) {
+            u_int64_t offset = (char *)b - (char *)a;
+            u_int64_t * link = &a->free_list;   // the link to b
+            u_int64_t * prev_link = NULL;       // the link to the previous block
+            block * prev = NULL;
+
+            while (*link && *link < offset) {
+                prev_link = link;
+                prev = reinterpret_cast<block *>((char *)a + *link);
+                link = &prev->next;
+            }
+
+            b->next = *link;
+            *link = offset;
+
+            // Merge with the next block
+            if (b->next && offset + b->size == b->next) {
+                block * next = reinterpret_cast<block *>((char *)a + b->next);
+                b->size += next->size;
+                b->next = next->next;
+            }
+
+            // Merge with the previous block
+            if (prev && (char *)prev + prev->size == (char *)b) {
+                prev->size += b->size;
+                prev->next = b->next;
+                b = prev;
+                link = prev_link;
+                offset = (char *)b - (char *)a;
+            }
+
+            // The last block borders unused space
+            if (b->next == 0 && offset + b->size == a->used) {
+                *link = 0;
+                a->used = offset;
+            }
+        }
+
+        static u_int64_t align_size64(u_int64_t val, u_int64_t alignment) {
+            return (val + alignment - 1) / alignment * alignment;
+        }
+
+        // Open the backing file on hugetlbfs, or a POSIX shared memory object
+        static int open_backing(const char * name, const char * hugepage_dir, int flags) {
+            local_state & local = state();
+            int fd = -1;
+
+            if (hugepage_dir && access(hugepage_dir, W_OK) == 0) {
+                snprintf(local.path, sizeof(local.path), "%s/shm_stl_%s", hugepage_dir, name);
+                fd = open(local.path, flags, 0600);
+                if (fd >= 0) {
+                    local.hugepage = true;
+                    return fd;
+                }
+            }
+
+            snprintf(local.path, sizeof(local.path), "/shm_stl_%s", name);
+            local.hugepage = false;
+            return shm_open(local.path, flags, 0600);
+        }
+
+        static bool create_arena(const char * name, size_t size, const char * hugepage_dir) {
+            local_state & local = state();
+            void * addr = MAP_FAILED;
+
+            int fd = open_backing(name, hugepage_dir, O_CREAT | O_RDWR | O_TRUNC);
+            if (fd >= 0 && local.hugepage) {
+                size = align_size64(size, HUGEPAGE_SIZE);
+                if (ftruncate(fd, size) == 0)
+                    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+                // Not enough hugepages, fall back to normal pages
+                if (addr == MAP_FAILED) {
+                    close(fd);
+                    unlink(local.path);
+                    fd = open_backing(name, NULL, O_CREAT | O_RDWR | O_TRUNC);
+                }
+            }
+
+            if (fd < 0)
+                return false;
+
+            if (addr == MAP_FAILED) {
+                if (ftruncate(fd, size) == 0)
+                    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+
+            close(fd);
+            if (addr == MAP_FAILED)
+                return false;
+
+            arena * a = static_cast<arena *>(addr);
+            a->lock.init();
+            a->base = (u_int64_t)addr;
+            a->size = size;
+            a->used = align_size64(sizeof(arena), SHM_CACHE_LINE_SIZE);
+            a->free_list = 0;
+            a->zone_num = 0;
+            __sync_synchronize();
+            a->magic = ARENA_MAGIC;
+
+            local.addr = a;
+            local.size = size;
+            local.type = SHM_PROC_PRIMARY;
+            return true;
+        }
+
+        static bool attach_arena(const char * name, const char * hugepage_dir) {
+            local_state & local = state();
+
+            int fd = open_backing(name, hugepage_dir, O_RDWR);
+            if (fd < 0)
+                return false;
+
+            // Read the address chosen by the primary
+            struct stat st;
+            void * addr = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(arena))
+                addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+            if (addr == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+
+            arena * header = static_cast<arena *>(addr);
+            void * base = (void *)header->base;
+            size_t size = header->size;
+            bool valid = (header->magic == ARENA_MAGIC);
+            munmap(addr, st.st_size);
+
+            addr = valid ? mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+
+            if (addr == MAP_FAILED)
+                return false;
+
+            // The address is taken by something else in this process
+            if (addr != base) {
+                munmap(addr, size);
+                return false;
+            }
+
+            local.addr = static_cast<arena *>(addr);
+            local.size = size;
+            local.type = SHM_PROC_SECONDARY;
+            return true;
+        }
+};
+
+#ifndef SHM_STL_NO_DPDK
+typedef dpdk_alloc default_alloc;
+#else
+typedef posix_alloc default_alloc;
+#endif
+
+__SHM_STL_END
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_ASYNC_QUEUE_H_
+#define __SHM_ASYNC_QUEUE_H_
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+
+#ifndef SHM_STL_NO_DPDK
+#include <rte_eal.h>
+#include <rte_memory.h>
+#include <rte_ring.h>
+#include <rte_mempool.h>
+#endif
+
+#include "shm_common.h"
+#include "shm_node_pool.h"
+
+struct rte_ring;
+
+__SHM_STL_BEGIN
+
+enum AsyncOp {
+    ASYNC_INSERT = 0,
+    ASYNC_ERASE,
+    ASYNC_UPDATE
+};
+
+/*
+ * @brief : A deferred change of hash table. Commands are allocated from a shared
+ *          mempool, so they can be passed between processes by pointer.
+ * */
+template <typename _Key, typename _Value>
+struct AsyncCommand {
+    u_int32_t op;      // one of AsyncOp
+    sig_t     sig;     // the signature of key, computed by the producer
+    bool      result;  // the result of this command, filled by the writer
+    u_int64_t cookie;  // opaque to hash table, returned with the completion
+    struct rte_ring * reply; // the completion ring of the producer, NULL if no completion is wanted
+    _Key      key;
+    _Value    value;   // the new value, or the erased value in the completion of erase
+};
+
+#ifndef SHM_STL_NO_DPDK
+
+/*
+ * @brief : AsyncQueue carries commands from any number of producers to one writer.
+ *
+ *          The command ring is multi-producer and single-consumer, the commands
+ *          are allocated from a mempool with per-lcore cache. A producer which
+ *          wants completions creates its own ring and passes it with commands,
+ *          the writer returns each finished command through that ring.
+ *
+ *          The primary process creates the ring and the mempool, secondary
+ *          processes look them up by name.
+ * */
+template <typename _Key, typename _Value>
+class AsyncQueue {
+    public:
+        typedef AsyncCommand<_Key, _Value> command_type;
+        static const uint32 DEFAULT_QUEUE_SIZE = 1024;
+        static const uint32 POOL_CACHE_SIZE = 32;
+
+        AsyncQueue() : m_ring(NULL), m_pool(NULL) {}
+        ~AsyncQueue() {}
+
+        bool create_or_attach(const char * name, uint32 size = DEFAULT_QUEUE_SIZE) {
+            char ring_name[RTE_RING_NAMESIZE];
+            char pool_name[RTE_RING_NAMESIZE];
+            // A truncated name may be the name of the queue of another map
+            if (snprintf(ring_name, sizeof(ring_name), "%s_AQ", name) >= (int)sizeof(ring_name) ||
+                snprintf(pool_name, sizeof(pool_name), "%s_AP", name) >= (int)sizeof(pool_name))
+                return false;
+
+            if (!is_power_of_2(size))
+                size = convert_to_power_of_2(size);
+
+            const rte_proc_type_t proc_type = rte_eal_process_type();
+            if (proc_type == RTE_PROC_PRIMARY) {
+                m_ring = rte_ring_create(ring_name, size, SOCKET_ID_ANY, RING_F_SC_DEQ);
+                // A command is either in the command ring, in a completion ring or
+                // in a lcore cache, the best mempool size is 2^n - 1
+                m_pool = rte_mempool_create(pool_name, (size << 1) - 1, sizeof(command_type),
+                                            POOL_CACHE_SIZE, 0, NULL, NULL, NULL, NULL, SOCKET_ID_ANY, 0);
+            } else if (proc_type == RTE_PROC_SECONDARY) {
+                m_ring = rte_ring_lookup(ring_name);
+                m_pool = rte_mempool_lookup(pool_name);
+            }
+
+            if (m_ring && m_pool) {
+                return true;
+            } else {
+                m_ring = NULL;
+                m_pool = NULL;
+                return false;
+            }
+        }
+
+        bool ready(void) const {return m_ring != NULL;}
+
+        // Get a free command, return NULL if all commands are in use
+        command_type * alloc(void) {
+            void * cmd = NULL;
+            if (rte_mempool_get(m_pool, &cmd) < 0)
+                return NULL;
+
+            return static_cast<command_type *>(cmd);
+        }
+
+        void free(command_type * cmd) {rte_mempool_put(m_pool, cmd);}
+
+        // Enqueue a command, the command is freed if the ring is full
+        bool enqueue(command_type * cmd) {
+            if (rte_ring_mp_enqueue(m_ring, cmd) == -ENOBUFS) {
+                free(cmd);
+                return false;
+            }
+
+            return true;
+        }
+
+        // Only the writer can dequeue commands
+        uint32 dequeue(command_type ** cmds, uint32 n) {
+            return rte_ring_sc_dequeue_burst(m_ring, reinterpret_cast<void **>(cmds), n);
+        }
+
+        // Return a finished command to its producer, or free it if nobody waits for it
+        void complete(command_type * cmd) {
+            if (cmd->reply == NULL || rte_ring_mp_enqueue(cmd->reply, cmd) == -ENOBUFS)
+                free(cmd);
+        }
+
+        // Copy at most n completions from reply to out, return the count of completions
+        uint32 poll(struct rte_ring * reply, command_type * out, uint32 n) {
+            void * cmds[POOL_CACHE_SIZE];
+            uint32 total = 0;
+
+            while (total < n) {
+                uint32 want = (n - total < POOL_CACHE_SIZE) ? (n - total) : POOL_CACHE_SIZE;
+                uint32 cnt = rte_ring_sc_dequeue_burst(reply, cmds, want);
+                for (uint32 i = 0; i < cnt; ++i)
+                    out[total + i] = *static_cast<command_type *>(cmds[i]);
+
+                if (cnt)
+                    rte_mempool_put_bulk(m_pool, cmds, cnt);
+
+                total += cnt;
+                if (cnt < want)
+                    break;
+            }
+
+            return total;
+        }
+
+    private:
+        struct rte_ring    * m_ring;  // the command ring
+        struct rte_mempool * m_pool;  // the free commands
+};
+
+#endif
+
+__SHM_STL_END
+
+#endif
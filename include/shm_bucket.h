@@ -25,6 +25,7 @@
 #include <sstream>
 #include <fstream>
 #include "shm_node_pool.h"
+#include "shm_lock.h"
 #include "shm_profiler.h"
 
 using std::ostream;
@@ -34,18 +35,43 @@ __SHM_STL_BEGIN
 const u_int32_t DEFAULT_BUCKET_NUM = 4096;
 const u_int32_t ENTRIES_PER_BUCKET = 16;
 
-template <typename _Node, typename _Key, typename _Value, typename _KeyEqual>
+// The entry evicted by an insert in cache mode
+template <typename _Key, typename _Value>
+struct Victim {
+    Victim() : evicted(false) {}
+
+    bool   evicted;
+    _Key   key;
+    _Value value;
+};
+
+/*
+ * @brief : A bucket is a chain of nodes guarded by a reader-writer lock of type
+ *          _Lock, rwlock or elided_rwlock. Its nodes come from its own node pool.
+ * */
+template <typename _Node, typename _Key, typename _Value, typename _KeyEqual, typename _Alloc = default_alloc,
+          typename _Lock = rwlock>
 class Bucket {
     public:
         typedef _Node node_t;
         typedef _Key  key_t;
         typedef _Value value_t;
-        typedef NodePool<node_t> node_pool_t;
+        typedef NodePool<node_t, _Alloc> node_pool_t;
+        typedef Victim<key_t, value_t> victim_t;
+        typedef _Lock lock_t;
 
     public:
         Bucket (uint32 pool_size = ENTRIES_PER_BUCKET)
-            : m_node_pool(pool_size), m_size(0), m_head(NULL){
-                rte_rwlock_init(&m_lock);
+            : m_node_pool(pool_size), m_size(0), m_head(NULL), m_gen(0)
+            , m_filter(0), m_filter_stale(0), m_hint(NULL), m_reorder(0), m_epoch(0) {
+                m_lock.init();
+            }
+
+        // The node pool starts with nodes given by the table, see NodePool
+        Bucket (node_t * nodes, uint32 count, volatile int64_t * allowance)
+            : m_node_pool(nodes, count, allowance), m_size(0), m_head(NULL), m_gen(0)
+            , m_filter(0), m_filter_stale(0), m_hint(NULL), m_reorder(0), m_epoch(0) {
+                m_lock.init();
             }
         ~Bucket () {}
 
@@ -53,118 +79,609 @@ class Bucket {
         uint32 free_entries(void) const {return m_node_pool.free_entries();}
 
         void clear(void) {
-            if (m_head == NULL) {
-                m_size = 0;
-                return;
+            write_lock();
+            clear_nolock();
+            m_lock.write_unlock();
+        }
+
+        /*
+         * @brief : Put a node at the head of this bucket, now is the access time of the new node.
+         *
+         *          If limit is not zero, this bucket works in cache mode: when it holds limit
+         *          nodes or its node pool is exhausted, an entry is evicted by CLOCK policy
+         *          and its node is reused. The evicted entry is copied to victim if it is
+         *          not NULL.
+         * */
+        bool put(const sig_t &signature, const key_t &key, const value_t &value, uint32 now = 0,
+                 uint32 limit = 0, victim_t * victim = NULL) {
+            write_lock();
+            bool ret = put_nolock(signature, key, value, now, limit, victim);
+            m_lock.write_unlock();
+            return ret;
+        }
+
+        // Lookup a node by signature and key, see accessed() for touch_gap.
+        // If gen is not NULL, it takes the generation of this bucket the result belongs to
+        bool lookup(const sig_t &sig, const key_t &key, value_t * ret, uint32 touch_gap = 0, uint32 * gen = NULL) {
+            read_lock();
+
+            if (gen) *gen = m_gen;
+
+            node_t* node = find_hot(sig, key, false);
+            if (node) {
+                if (ret) *ret = node->value();
+                accessed(node, touch_gap);
             }
 
-            rte_rwlock_write_lock(&m_lock);
-            
-            // return nodes to node pool
-            node_t* end = m_head;
-            while (end->next())
-                end = end->next();
+            m_lock.read_unlock();
 
-            m_node_pool.put_nodelist(m_head, end, m_size);
+            if (node)
+                return true;
+            else
+                return false;
+        }
 
-            m_size = 0;
-            m_head = NULL;
+        /*
+         * @brief : Lookup without the lock, for a bucket changed by a single writer
+         *          without locks. The chain may change under the walk, so the caller
+         *          checks that no change was made meanwhile, and the walk gives up
+         *          after max_steps nodes.
+         * */
+        bool peek(const sig_t &sig, const key_t &key, value_t * ret, uint32 max_steps) const {
+            const node_t * node = m_head;
+            for (uint32 steps = 0; node && steps < max_steps; ++steps) {
+                if (sig == node->signature() && m_equal_to(key, node->key())) {
+                    if (ret) *ret = node->value();
+                    return true;
+                }
+                node = node->next();
+            }
 
-            rte_rwlock_write_unlock(&m_lock);
-            return;
+            return false;
         }
 
-        // Put a node at the head of this bucket
-        bool put(const sig_t &signature, const key_t &key, const value_t &value) {
-            bool ret = true;
-            node_t * node = NULL;
+        // Remove a node from this bucket
+        bool remove(const sig_t &sig, const key_t &key, value_t * ret) {
+            write_lock();
+            bool found = remove_nolock(sig, key, ret);
+            m_lock.write_unlock();
+            return found;
+        }
 
-            rte_rwlock_write_lock(&m_lock);
+        // update a node in this bucket
+        template <typename _Params, typename _Modifier>
+        bool update(const sig_t &sig, const key_t &key, _Params &params, _Modifier &action, uint32 now = 0) {
+            write_lock();
+            bool ret = update_nolock(sig, key, params, action, now);
+            m_lock.write_unlock();
+            return ret;
+        } 
 
-            // check if this key is already in this bucket
-            if (find_node(signature, key)) {
-                ret = false;
-                goto exit;
-            }
+        /*
+         * @brief : Lock this bucket and find the node of key, used by accessors. The
+         *          lock is kept only if the node is found, and then it is released by
+         *          release(write). The value of node may be modified in place with the
+         *          write lock, release() increases the generation in that case.
+         * */
+        node_t * acquire(const sig_t &sig, const key_t &key, bool write, uint32 touch_gap = 0) {
+            if (write)
+                write_lock();
+            else
+                read_lock();
 
-            node = m_node_pool.get_node();
-            if (node == NULL) {
-                ret = false;
-                goto exit;
+            node_t * node = find_hot(sig, key, write);
+            if (node) {
+                accessed(node, touch_gap);
+            } else if (write) {
+                m_lock.write_unlock();
+            } else {
+                m_lock.read_unlock();
             }
-            node->fill(key, value, signature);
-            node->set_next(m_head);
-            m_head = node;
-            ++m_size;
-            
-exit:
-            rte_rwlock_write_unlock(&m_lock);
-            return ret;
+
+            return node;
         }
 
-        // Lookup a node by signature and key
-        bool lookup(const sig_t &sig, const key_t &key, value_t * ret) {
-            rte_rwlock_read_lock(&m_lock);
+        // Like acquire() with the write lock, but insert the key with value if it is absent
+        node_t * acquire_or_put(const sig_t &sig, const key_t &key, const value_t &value, uint32 now = 0,
+                                uint32 limit = 0, victim_t * victim = NULL, bool * inserted = NULL) {
+            write_lock();
 
-            node_t* node = find_node(sig, key);
-            if (node && ret) *ret = node->value();
+            node_t * node = find_or_put_nolock(sig, key, value, now, limit, victim, inserted);
+            if (node == NULL)
+                m_lock.write_unlock();
 
-            rte_rwlock_read_unlock(&m_lock);
+            return node;
+        }
 
-            if (node)
-                return true;
-            else
+        void release(bool write) {
+            if (write) {
+                ++m_gen;
+                m_lock.write_unlock();
+            } else {
+                m_lock.read_unlock();
+            }
+        }
+
+        /*
+         * @brief : Insert the key with value if it is absent, otherwise update its
+         *          value by action(old value, value). One lock acquisition and one
+         *          chain walk. inserted takes whether the key was absent.
+         *
+         *          Return false only if the key is absent and no node is available.
+         * */
+        template <typename _Modifier>
+        bool upsert(const sig_t &sig, const key_t &key, const value_t &value, _Modifier &action,
+                    uint32 now = 0, uint32 limit = 0, victim_t * victim = NULL, bool * inserted = NULL) {
+            write_lock();
+            bool ret = upsert_nolock(sig, key, value, action, now, limit, victim, inserted);
+            m_lock.write_unlock();
+            return ret;
+        }
+
+        /*
+         * @brief : Copy the value of key to ret if it exists, otherwise insert the
+         *          key with value and copy value to ret. One lock acquisition and one
+         *          chain walk. inserted takes whether the key was absent.
+         *
+         *          Return false only if the key is absent and no node is available.
+         * */
+        bool find_or_put(const sig_t &sig, const key_t &key, const value_t &value, value_t * ret,
+                         uint32 now = 0, uint32 limit = 0, victim_t * victim = NULL, bool * inserted = NULL) {
+            node_t * node = acquire_or_put(sig, key, value, now, limit, victim, inserted);
+            if (node == NULL)
                 return false;
+
+            if (ret)
+                *ret = node->value();
+
+            m_lock.write_unlock();
+            return true;
         }
 
-        // Remove a node from this bucket
-        bool remove(const sig_t &sig, const key_t &key, value_t * ret) {
-            rte_rwlock_write_lock(&m_lock);
+        /*
+         * Following methods are used by hash_multimap, value_t is a ValueBlock.
+         *
+         * The values of a key are kept in a run of adjacent nodes, each holding a
+         * block of values. A new node is linked after the last node of the run when
+         * its block is full, so the values of a key are read by a sequential scan.
+         * */
+        template <typename _Item>
+        bool append(const sig_t &sig, const key_t &key, const _Item &item, uint32 now = 0) {
+            write_lock();
 
             node_t * node = find_node(sig, key);
+            node_t * last = node;
+            while (last && in_run(last->next(), sig, key))
+                last = last->next();
 
-            // If we find this node, now it is in the front of our node list,
-            // we just remove it from the head
-            if (node) {
-                if (ret)
-                    *ret = node->value();
+            bool ret = true;
+            if (last == NULL || last->value().full()) {
+                node_t * block = m_node_pool.get_node();
+                if (block) {
+                    block->fill(key, value_t(), sig);
+                    block->clear_reference();
+                    m_filter |= filter_bits(sig);
+                    if (last) {
+                        block->set_next(last->next());
+                        last->set_next(block);
+                    } else {
+                        block->set_next(m_head);
+                        m_head = block;
+                    }
+                    ++m_size;
+                }
+                last = block;
+            }
 
-                m_head = node->next();
-                node->set_next(NULL);
+            if (last) {
+                last->value().push(item);
+                last->touch(now);
+                ++m_gen;
+            } else {
+                ret = false;
+            }
+
+            m_lock.write_unlock();
+            return ret;
+        }
+
+        // Copy at most max values of key to out, return the count of values of key
+        template <typename _Item>
+        uint32 lookup_all(const sig_t &sig, const key_t &key, _Item * out, uint32 max) {
+            read_lock();
+
+            uint32 total = 0;
+            for (node_t * node = find_node(sig, key); in_run(node, sig, key); node = node->next()) {
+                const value_t &block = node->value();
+                for (uint32 i = 0; i < block.size(); ++i, ++total) {
+                    if (out && total < max)
+                        out[total] = block[i];
+                }
+            }
+
+            m_lock.read_unlock();
+            return total;
+        }
+
+        /*
+         * Remove one value of key which equals to item. The hole is filled by the
+         * last value of the run, so only the last block of a run is not full, and
+         * its node is released when it becomes empty.
+         * */
+        template <typename _Item, typename _ItemEqual>
+        bool remove_value(const sig_t &sig, const key_t &key, const _Item &item, _ItemEqual &equal) {
+            write_lock();
+
+            node_t * prev = NULL;
+            node_t * first = find_node(sig, key, &prev);
+            node_t * target = NULL;
+            uint32 index = 0;
+            node_t * last = NULL;
+            node_t * last_prev = prev;
+
+            for (node_t * node = first; in_run(node, sig, key); node = node->next()) {
+                if (target == NULL) {
+                    const value_t &block = node->value();
+                    for (uint32 i = 0; i < block.size(); ++i) {
+                        if (equal(block[i], item)) {
+                            target = node;
+                            index = i;
+                            break;
+                        }
+                    }
+                }
+
+                if (last)
+                    last_prev = last;
+                last = node;
+            }
+
+            if (target) {
+                value_t &tail = last->value();
+                target->value()[index] = tail[tail.size() - 1];
+                tail.pop();
+
+                if (tail.size() == 0) {
+                    unlink_node(last, last_prev);
+                    --m_size;
+                    m_node_pool.put_node(last);
+                    filter_removed(1);
+                }
+                ++m_gen;
+            }
+
+            m_lock.write_unlock();
+            return target != NULL;
+        }
+
+        // Remove all values of key, return the count of removed values
+        uint32 remove_all(const sig_t &sig, const key_t &key) {
+            write_lock();
+
+            uint32 removed = 0;
+            uint32 blocks = 0;
+            node_t * prev = NULL;
+            node_t * node = find_node(sig, key, &prev);
+            while (in_run(node, sig, key)) {
+                node_t * next = node->next();
+                removed += node->value().size();
+                unlink_node(node, prev);
                 --m_size;
-                
-                // put this node back to node_pool
                 m_node_pool.put_node(node);
+                node = next;
+                ++blocks;
             }
 
-            rte_rwlock_write_unlock(&m_lock);
+            if (blocks) {
+                ++m_gen;
+                filter_removed(blocks);
+            }
 
+            m_lock.write_unlock();
+            return removed;
+        }
+
+        /*
+         * Following methods do not use lock, the caller should hold the write lock
+         * by write_lock(). They are used to apply a batch of changes to a bucket
+         * with one lock acquisition.
+         * */
+        void write_lock(void) {
+            SHM_PROFILE_SCOPE("bucket.write_lock");
+            m_lock.write_lock();
+        }
+        void write_unlock(void) {m_lock.write_unlock();}
+
+        // Drop all nodes in O(1), the node pool is reset instead of taking them back
+        void clear_nolock(void) {
+            m_head = NULL;
+            m_size = 0;
+            m_node_pool.reset();
+            m_filter = 0;
+            m_filter_stale = 0;
+            m_hint = NULL;
+            ++m_gen;
+        }
+
+        bool put_nolock(const sig_t &signature, const key_t &key, const value_t &value, uint32 now = 0,
+                        uint32 limit = 0, victim_t * victim = NULL) {
+            if (m_reorder)
+                promote_hint();
+
+            // check if this key is already in this bucket
+            if (find_node(signature, key))
+                return false;
+
+            return link_new(signature, key, value, now, limit, victim) != NULL;
+        }
+
+        /*
+         * A node can be got from the node pool before the lock is taken, so the lock
+         * is not held while the pool is accessed. reserve() gets it without lock,
+         * put_reserved_nolock() links it with the write lock, and unreserve() puts
+         * it back if it is not used. A node reserved before clear_nolock() is not
+         * used or put back, as the pool has taken back all nodes. stamp takes the
+         * state of the pool for this check. Not for cache mode.
+         * */
+        node_t * reserve(uint32 * stamp) {return m_node_pool.reserve_node(stamp);}
+
+        void unreserve(node_t * node, uint32 stamp) {
             if (node)
-                return true;
-            else
+                m_node_pool.unreserve_node(node, stamp);
+        }
+
+        // Like put_nolock(), spare is set to NULL if it is linked
+        bool put_reserved_nolock(const sig_t &signature, const key_t &key, const value_t &value, uint32 now,
+                                 node_t ** spare, uint32 stamp) {
+            if (m_reorder)
+                promote_hint();
+
+            if (find_node(signature, key))
                 return false;
+
+            if (*spare == NULL || stamp != m_node_pool.resets())
+                return link_new(signature, key, value, now, 0, NULL) != NULL;
+
+            link_node(*spare, signature, key, value, now);
+            *spare = NULL;
+            return true;
         }
 
-        // update a node in this bucket
-        template <typename _Params, typename _Modifier>
-        bool update(const sig_t &sig, const key_t &key, _Params &params, _Modifier &action) {
-            rte_rwlock_write_lock(&m_lock);
+        bool remove_nolock(const sig_t &sig, const key_t &key, value_t * ret) {
+            node_t * prev = NULL;
+            node_t * node = find_node(sig, key, &prev);
 
-            bool ret = false;
-            node_t * node = find_node(sig, key);
+            // If we find this node, unlink it from our node list
+            if (node == NULL)
+                return false;
+
+            if (ret)
+                *ret = node->value();
+
+            unlink_node(node, prev);
+            --m_size;
+            ++m_gen;
+
+            // put this node back to node_pool
+            m_node_pool.put_node(node);
+            filter_removed(1);
+            return true;
+        }
+
+        template <typename _Params, typename _Modifier>
+        bool update_nolock(const sig_t &sig, const key_t &key, _Params &params, _Modifier &action, uint32 now = 0) {
+            node_t * node = find_hot(sig, key, true);
 
             // If we find this node, update it! 
+            if (node == NULL)
+                return false;
+
+            node->update(params, action);
+            node->touch(now);
+            ++m_gen;
+            return true;
+        }
+
+        template <typename _Modifier>
+        bool upsert_nolock(const sig_t &sig, const key_t &key, const value_t &value, _Modifier &action,
+                           uint32 now = 0, uint32 limit = 0, victim_t * victim = NULL, bool * inserted = NULL) {
+            bool ret = true;
+            node_t * node = find_hot(sig, key, true);
             if (node) {
+                // A copy, so upsert takes the same modifiers as update
+                value_t params = value;
                 node->update(params, action);
-                ret = true;
+                node->touch(now);
+                ++m_gen;
+            } else {
+                ret = (link_new(sig, key, value, now, limit, victim) != NULL);
             }
-            
-            rte_rwlock_write_unlock(&m_lock);
+
+            if (inserted)
+                *inserted = ret && (node == NULL);
             return ret;
-        } 
+        }
+
+        // Return the node of key, insert the key with value first if it is absent
+        node_t * find_or_put_nolock(const sig_t &sig, const key_t &key, const value_t &value, uint32 now = 0,
+                                    uint32 limit = 0, victim_t * victim = NULL, bool * inserted = NULL) {
+            node_t * node = find_hot(sig, key, true);
+            bool found = (node != NULL);
+            if (found) {
+                if (!node->referenced())
+                    node->reference();
+                if (now)
+                    node->touch(now);
+            } else {
+                node = link_new(sig, key, value, now, limit, victim);
+            }
+
+            if (inserted)
+                *inserted = (node != NULL) && !found;
+            return node;
+        }
+
+        /*
+         * @brief : Move the nodes which belong to other buckets under a new seed,
+         *          where(sig) returns the new bucket of a signature. The lock of the
+         *          new bucket is taken for each moved node. All nodes are copied
+         *          before any is unlinked, so a key is never missing from both.
+         *          epoch is recorded if it succeeds, see hash_table::reseed().
+         *
+         *          Return false if a new bucket has no free node, nothing moves then.
+         * */
+        template <typename _Where>
+        bool rehash_nolock(_Where &where, uint32 epoch, uint32 * moved) {
+            node_t * curr = m_head;
+            for ( ; curr; curr = curr->next()) {
+                Bucket * dest = where(curr->signature());
+                if (dest == this)
+                    continue;
+
+                dest->write_lock();
+                node_t * copy = dest->link_new(curr->signature(), curr->key(), curr->value(), curr->atime(), 0, NULL);
+                dest->write_unlock();
+                if (copy == NULL)
+                    break;
+            }
+
+            if (curr) {
+                // Take back the copies made so far
+                for (node_t * done = m_head; done != curr; done = done->next()) {
+                    Bucket * dest = where(done->signature());
+                    if (dest != this)
+                        dest->remove(done->signature(), done->key(), NULL);
+                }
+                return false;
+            }
+
+            uint32 count = 0;
+            node_t * prev = NULL;
+            curr = m_head;
+            while (curr) {
+                node_t * next = curr->next();
+                if (where(curr->signature()) != this) {
+                    unlink_node(curr, prev);
+                    m_node_pool.put_node(curr);
+                    ++count;
+                } else {
+                    prev = curr;
+                }
+                curr = next;
+            }
+
+            if (count) {
+                m_size -= count;
+                m_hint = NULL;
+                filter_removed(count);
+                *moved += count;
+            }
+
+            m_epoch = epoch;
+            ++m_gen;
+            return true;
+        }
+
+        /*
+         * @brief : Remove nodes which have not been accessed for ttl ticks. The
+         *          removed nodes are returned to node pool as one list.
+         *
+         *          work is increased by the number of nodes visited, so the caller
+         *          can bound the cost of a sweep over many buckets.
+         *
+         *          Return the number of removed nodes
+         * */
+        uint32 expire(uint32 now, uint32 ttl, uint32 &work) {
+            ++work;
+
+            // Nothing to do, avoid touching the lock
+            if (m_size == 0)
+                return 0;
+
+            uint32 expired = 0;
+            node_t * start = NULL;
+            node_t * end = NULL;
+
+            write_lock();
+
+            node_t * prev = NULL;
+            node_t * curr = m_head;
+            while (curr) {
+                node_t * next = curr->next();
+                ++work;
+
+                if (now - curr->atime() >= ttl) {
+                    unlink_node(curr, prev);
+
+                    // chain expired nodes together, the first one is the tail
+                    curr->set_next(start);
+                    if (end == NULL)
+                        end = curr;
+                    start = curr;
+                    ++expired;
+                } else {
+                    prev = curr;
+                }
+
+                curr = next;
+            }
+
+            if (expired) {
+                m_size -= expired;
+                ++m_gen;
+                m_node_pool.put_nodelist(start, end, expired);
+                m_node_pool.shrink();
+                filter_removed(expired);
+            }
+
+            m_lock.write_unlock();
+            return expired;
+        }
+
+        // Release idle node lists of this bucket, return the count of released nodes
+        uint32 shrink(void) {
+            write_lock();
+            uint32 released = m_node_pool.shrink();
+            m_lock.write_unlock();
+            return released;
+        }
 
         uint32  size(void) const {return m_size;}
 
+        /*
+         * @brief : Reorder the chain by access, so hot nodes stay near the head.
+         *          A writer moves the node it finds to the head. A reader cannot
+         *          change the chain, it leaves the node it finds deep in the chain
+         *          as a hint, and the next writer moves that node to the head.
+         *          In cache mode the tail of the chain is then the least recently
+         *          used, so CLOCK eviction gets closer to LRU.
+         * */
+        void set_reorder(bool enable) {
+            m_reorder = enable ? 1 : 0;
+            m_hint = NULL;
+        }
+
+        /*
+         * @brief : Check the filter of this bucket without lock. False means the
+         *          signature is not in this bucket, true means it may be.
+         *
+         *          The filter is a 64-bit Bloom filter with two bits per signature.
+         *          Writers set the bits before a node is linked. Removed nodes leave
+         *          their bits set until the filter is rebuilt, which happens when
+         *          there are more stale removals than nodes.
+         * */
+        bool may_contain(const sig_t &sig) const {
+            u_int64_t bits = filter_bits(sig);
+            return (m_filter & bits) == bits;
+        }
+
+        // The generation is increased by every change of this bucket, so a copy of
+        // an entry is still valid if the generation does not change
+        uint32  generation(void) const {return m_gen;}
+
+        // The epoch of the table when this bucket was rehashed last time
+        uint32  epoch(void) const {return m_epoch;}
+
         void str(ostream &os) const {
             os << "\nBucket Size : " << m_size << std::endl;
             node_t* curr = m_head;
@@ -175,26 +692,244 @@ exit:
         }
 
     private:
-        node_t * find_node(const sig_t &sig, const key_t &key) const {
+        void read_lock(void) {
+            SHM_PROFILE_SCOPE("bucket.read_lock");
+            m_lock.read_lock();
+        }
+
+        // If prev is not NULL, it takes the node in front of the found node
+        node_t * find_node(const sig_t &sig, const key_t &key, node_t ** prev = NULL) const {
+            SHM_PROFILE_SCOPE("bucket.walk");
+
             // Search in this bucket
+            node_t * before = NULL;
             node_t * current = m_head;
             while (current) {
                 if (sig == current->signature() && m_equal_to(key, current->key())) {
                     break;
                 }
 
+                before = current;
                 current = current->next();
             }
 
+            if (prev)
+                *prev = before;
+
             return current;
         }
 
+        static u_int64_t filter_bits(const sig_t &sig) {
+            // The low bits of signature select the bucket, mix the high bits in
+            uint32 h = (uint32)sig * 0x9E3779B1U;
+            return (1ULL << (h >> 26)) | (1ULL << ((h >> 20) & 63));
+        }
+
+        // Record removed nodes, rebuild the filter when half of its bits may be stale
+        void filter_removed(uint32 count) {
+            m_filter_stale += count;
+            if (m_filter_stale <= m_size)
+                return;
+
+            u_int64_t filter = 0;
+            for (node_t * curr = m_head; curr; curr = curr->next())
+                filter |= filter_bits(curr->signature());
+
+            m_filter = filter;
+            m_filter_stale = 0;
+        }
+
+        // find_node() which reorders the chain if it is enabled, write tells whether
+        // the caller holds the write lock
+        node_t * find_hot(const sig_t &sig, const key_t &key, bool write) {
+            if (!m_reorder)
+                return find_node(sig, key);
+
+            if (write)
+                promote_hint();
+
+            node_t * prev = NULL;
+            node_t * node = find_node(sig, key, &prev);
+            if (node == NULL || prev == NULL)
+                return node;
+
+            if (write)
+                move_to_front(node, prev);
+            else if (prev != m_head && m_hint != node)
+                m_hint = node; // deeper than the second node
+
+            return node;
+        }
+
+        // Move a node to the head, prev is the node in front of it. Nodes next to
+        // a node with the same signature stay, so blocks of a multimap key are adjacent
+        void move_to_front(node_t * node, node_t * prev) {
+            node_t * next = node->next();
+            if (prev->signature() == node->signature() || (next && next->signature() == node->signature()))
+                return;
+
+            prev->set_next(next);
+            node->set_next(m_head);
+            m_head = node;
+        }
+
+        // Move the hinted node to the head if it is still in this bucket
+        void promote_hint(void) {
+            node_t * hint = m_hint;
+            if (hint == NULL)
+                return;
+
+            m_hint = NULL;
+            node_t * prev = NULL;
+            for (node_t * curr = m_head; curr; prev = curr, curr = curr->next()) {
+                if (curr == hint) {
+                    if (prev)
+                        move_to_front(curr, prev);
+                    break;
+                }
+            }
+        }
+
+        // Mark a found node as accessed. If touch_gap is not zero, its access time
+        // is refreshed once it is older than touch_gap ticks, so a hot node does not
+        // dirty its cache line on every lookup.
+        void accessed(node_t * node, uint32 touch_gap) {
+            // Only write the reference bit if it is not set, it is cleared by eviction
+            if (!node->referenced())
+                node->reference();
+
+            if (touch_gap) {
+                uint32 now = coarse_ticks();
+                if (now - node->atime() >= touch_gap)
+                    node->touch(now);
+            }
+        }
+
+        /*
+         * Get a node, evicting one in cache mode if needed, fill it and link it at
+         * the head. The caller makes sure the key is not in this bucket.
+         * */
+        node_t * link_new(const sig_t &signature, const key_t &key, const value_t &value, uint32 now,
+                          uint32 limit, victim_t * victim) {
+            node_t * node = NULL;
+            if (limit == 0 || m_size < limit)
+                node = m_node_pool.get_node();
+
+            if (node == NULL && limit != 0)
+                node = evict(victim);
+
+            if (node == NULL)
+                return NULL;
+
+            link_node(node, signature, key, value, now);
+            return node;
+        }
+
+        void link_node(node_t * node, const sig_t &signature, const key_t &key, const value_t &value, uint32 now) {
+            node->fill(key, value, signature);
+            node->touch(now);
+            node->clear_reference();
+            // The filter is updated before the node is linked
+            m_filter |= filter_bits(signature);
+            node->set_next(m_head);
+            m_head = node;
+            ++m_size;
+            ++m_gen;
+        }
+
+        // If node is not NULL and holds key
+        bool in_run(const node_t * node, const sig_t &sig, const key_t &key) const {
+            return node && sig == node->signature() && m_equal_to(key, node->key());
+        }
+
+        /*
+         * CLOCK eviction. New nodes are put at the head, so the chain is ordered from
+         * the youngest to the oldest and the clock hand always starts at the oldest
+         * node. The oldest unreferenced node is the victim. The referenced nodes
+         * older than it get a second chance: they lose their reference bits and are
+         * moved to the head, as if the hand had passed them. If every node is
+         * referenced, all bits are cleared and the oldest node is evicted.
+         *
+         * The victim is unlinked and returned for reuse, m_size is decreased.
+         * */
+        node_t * evict(victim_t * victim) {
+            if (m_head == NULL)
+                return NULL;
+
+            // Find the oldest unreferenced node and the tail
+            node_t * target = NULL;
+            node_t * target_prev = NULL;
+            node_t * prev = NULL;
+            node_t * tail = m_head;
+            while (true) {
+                if (!tail->referenced()) {
+                    target = tail;
+                    target_prev = prev;
+                }
+
+                if (tail->next() == NULL)
+                    break;
+
+                prev = tail;
+                tail = tail->next();
+            }
+
+            // The nodes passed by the hand keep their order if all nodes are referenced
+            node_t * passed = NULL;
+            if (target == NULL) {
+                target = tail;
+                target_prev = prev;
+                for (node_t * curr = m_head; curr; curr = curr->next())
+                    curr->clear_reference();
+            } else {
+                passed = target->next();
+                for (node_t * curr = passed; curr; curr = curr->next())
+                    curr->clear_reference();
+            }
+
+            if (victim) {
+                victim->evicted = true;
+                victim->key = target->key();
+                victim->value = target->value();
+            }
+
+            unlink_node(target, target_prev);
+            --m_size;
+            filter_removed(1);
+
+            // Move the passed nodes to the head, they are younger than the others now.
+            // target_prev is in front of them after target is unlinked.
+            if (passed && target_prev) {
+                target_prev->set_next(NULL);
+                tail->set_next(m_head);
+                m_head = passed;
+            }
+
+            return target;
+        }
+
+        // Unlink node from the chain, prev is the node in front of it or NULL
+        void unlink_node(node_t * node, node_t * prev) {
+            if (prev)
+                prev->set_next(node->next());
+            else
+                m_head = node->next();
+
+            node->set_next(NULL);
+        }
+
     public:
         node_pool_t m_node_pool;
         volatile uint32 m_size; // the size of this bucket
         node_t * volatile m_head; // the pointer of the first node in this bucket
         _KeyEqual m_equal_to;
-        rte_rwlock_t m_lock;
+        lock_t m_lock;
+        volatile uint32 m_gen; // the generation of this bucket, increased by writers
+        volatile u_int64_t m_filter; // the Bloom filter of signatures in this bucket
+        uint32 m_filter_stale; // the count of removed nodes since the filter is rebuilt
+        node_t * volatile m_hint; // a hot node found deep in the chain by a reader
+        volatile u_int8_t m_reorder; // reorder the chain by access if it is not zero
+        volatile uint32 m_epoch; // written by rehash_nolock() only
 }; 
 
 __SHM_STL_END
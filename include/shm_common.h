@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <iostream>
+#include "shm_platform.h"
 
 #include "shm_stl_config.h"
 
@@ -45,6 +46,29 @@ align_size(u_int32_t val, u_int32_t alignment)
     return alignment * div_roundup(val, alignment);
 }
 
+/* Coarse timestamps used for entry aging. One tick is 2^TICK_SHIFT TSC cycles,
+ * so a 32-bit tick counter wraps after about one day on a 3GHz core. Ticks
+ * should only be compared by unsigned subtraction.
+ */
+static const u_int32_t TICK_SHIFT = 16;
+
+static inline u_int32_t
+coarse_ticks(void) {
+    return (u_int32_t)(read_tsc() >> TICK_SHIFT);
+}
+
+/* Convert milliseconds to coarse ticks, the result is at least 1 */
+static inline u_int32_t
+ms_to_ticks(u_int32_t ms) {
+    u_int64_t ticks = ((u_int64_t)ms * tsc_hz() / 1000) >> TICK_SHIFT;
+
+    // keep ttl below half of the tick range so unsigned subtraction works
+    if (ticks > 0x7fffffff)
+        ticks = 0x7fffffff;
+
+    return (ticks == 0) ? 1 : (u_int32_t)ticks;
+}
+
 __SHM_STL_END
 
 #endif
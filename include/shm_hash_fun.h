@@ -32,14 +32,71 @@
 #define __SHM_STL_HASH_FUN_H
 
 #include <stddef.h>
-#include <rte_jhash.h>
+#include <string.h>
+#include <sys/types.h>
 #include "shm_stl_config.h"
 
 __SHM_STL_BEGIN
 
+#define __shm_jhash_mix(a, b, c) do { \
+    a -= b; a -= c; a ^= (c >> 13); \
+    b -= c; b -= a; b ^= (a << 8);  \
+    c -= a; c -= b; c ^= (b >> 13); \
+    a -= b; a -= c; a ^= (c >> 12); \
+    b -= c; b -= a; b ^= (a << 16); \
+    c -= a; c -= b; c ^= (b >> 5);  \
+    a -= b; a -= c; a ^= (c >> 3);  \
+    b -= c; b -= a; b ^= (a << 10); \
+    c -= a; c -= b; c ^= (b >> 15); \
+} while (0)
+
+/* The jhash of DPDK 1.6 (rte_jhash). It is built in, so DPDK and non-DPDK
+ * processes which share a table always get the same hash value of a key.
+ */
+inline u_int32_t
+shm_jhash(const void *key, u_int32_t length, u_int32_t initval)
+{
+    const u_int8_t *k = (const u_int8_t *)key;
+    u_int32_t len = length;
+    u_int32_t a = 0x9e3779b9; // the golden ratio
+    u_int32_t b = 0x9e3779b9;
+    u_int32_t c = initval;
+
+    while (len >= 12) {
+        a += (k[0] + ((u_int32_t)k[1] << 8) + ((u_int32_t)k[2] << 16) + ((u_int32_t)k[3] << 24));
+        b += (k[4] + ((u_int32_t)k[5] << 8) + ((u_int32_t)k[6] << 16) + ((u_int32_t)k[7] << 24));
+        c += (k[8] + ((u_int32_t)k[9] << 8) + ((u_int32_t)k[10] << 16) + ((u_int32_t)k[11] << 24));
+        __shm_jhash_mix(a, b, c);
+        k += 12;
+        len -= 12;
+    }
+
+    c += length;
+    switch (len) {
+        case 11: c += ((u_int32_t)k[10] << 24); // fall through
+        case 10: c += ((u_int32_t)k[9] << 16); // fall through
+        case 9 : c += ((u_int32_t)k[8] << 8); // fall through
+        case 8 : b += ((u_int32_t)k[7] << 24); // fall through
+        case 7 : b += ((u_int32_t)k[6] << 16); // fall through
+        case 6 : b += ((u_int32_t)k[5] << 8); // fall through
+        case 5 : b += k[4]; // fall through
+        case 4 : a += ((u_int32_t)k[3] << 24); // fall through
+        case 3 : a += ((u_int32_t)k[2] << 16); // fall through
+        case 2 : a += ((u_int32_t)k[1] << 8); // fall through
+        case 1 : a += k[0];
+        default: break;
+    };
+
+    __shm_jhash_mix(a, b, c);
+
+    return c;
+}
+
+#undef __shm_jhash_mix
+
 template <class _Key> struct hash {
     size_t operator() (const _Key &key) const {
-        return rte_jhash(&key, sizeof(key), 0);
+        return shm_jhash(&key, sizeof(key), 0);
     }
 };
 
@@ -90,6 +147,61 @@ __SHM_STL_TEMPLATE_NULL struct hash<unsigned long> {
   size_t operator()(unsigned long __x) const { return __x; }
 };
 
+/* Mix a 32-bit value with a seed (the finalizer of MurmurHash3) */
+inline u_int32_t
+shm_hash_mix32(u_int32_t h, u_int32_t seed)
+{
+    h ^= seed;
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/* The hash value of a key under a seed. A table hashes its keys with its own
+ * random secret, so keys can not be chosen in advance to have equal hash values.
+ * shm_stl::hash and the string hashes hash the key with the seed. Any other
+ * hasher is called as it is and its value is mixed with the seed, keys of equal
+ * values under such a hasher stay equal under every seed.
+ */
+template <class _HashFunc, class _Key>
+inline u_int32_t
+seeded_hash(const _HashFunc & hash_func, const _Key & key, u_int32_t seed)
+{
+    return shm_hash_mix32((u_int32_t)hash_func(key), seed);
+}
+
+template <class _Key>
+inline u_int32_t
+seeded_hash(const hash<_Key> &, const _Key & key, u_int32_t seed)
+{
+    return shm_jhash(&key, sizeof(key), seed);
+}
+
+inline u_int32_t
+seeded_hash(const hash<char*> &, char * const & key, u_int32_t seed)
+{
+    return shm_jhash(key, strlen(key), seed);
+}
+
+inline u_int32_t
+seeded_hash(const hash<const char*> &, const char * const & key, u_int32_t seed)
+{
+    return shm_jhash(key, strlen(key), seed);
+}
+
+/* Compare keys by memcmp. It is faster than operator== for plain structures
+ * without padding, such as flow keys. Keys with padding bytes should be zeroed
+ * before they are filled.
+ */
+template <class _Key> struct bitwise_equal_to {
+  bool operator()(const _Key& __x, const _Key& __y) const {
+    return memcmp(&__x, &__y, sizeof(_Key)) == 0;
+  }
+};
+
 __SHM_STL_END
 
 #endif /* __SGI_STL_HASH_FUN_H */
@@ -22,6 +22,7 @@
 
 #include "shm_hash_table.h"
 #include "shm_profiler.h"
+#include "shm_skew_monitor.h"
 
 #include <iostream>
 #include <sstream>
@@ -29,9 +30,6 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <rte_memzone.h>
-#include <rte_string_fns.h>
-
 #define RETURN_FALSE_IF_NULL(ptr) do {\
     if (ptr == NULL) return false;\
 } while (0)
@@ -40,44 +38,131 @@
 
 __SHM_STL_BEGIN
 
-template <typename _Key, typename _Value, typename _HashFunc = hash<_Key>, typename _EqualKey = std::equal_to<_Key> >
+// An entry of the per-lcore local cache, it remembers the result of a find
+template <typename _Key, typename _Value>
+struct LocalEntry {
+    uint32 gen;   // the generation of the bucket when this entry is filled
+    uint32 bucket; // the index of that bucket
+    sig_t  sig;
+    uint32 stamp; // the fill time in coarse ticks, only used if expiry is enabled
+    bool   valid;
+    bool   found; // false means the key was not in the hash table
+    _Key   key;
+    _Value value;
+};
+
+/*
+ * @brief : hash_map is the per-process handle of a shared hash table.
+ *
+ *          _Alloc decides where the table lives and which role this process plays,
+ *          see shm_allocator.h. With dpdk_alloc (the default) the table is in a DPDK
+ *          memzone, with posix_alloc it is in a POSIX shared memory arena, so it can
+ *          be shared with processes which do not run DPDK.
+ *
+ *          _Lock is the lock of buckets. elided_rwlock runs bucket operations in
+ *          hardware transactions on CPUs with RTM, see shm_lock.h.
+ * */
+template <typename _Key, typename _Value, typename _HashFunc = hash<_Key>, typename _EqualKey = std::equal_to<_Key>,
+          typename _Alloc = default_alloc, typename _Lock = rwlock>
 class hash_map {
     public:
         typedef _Key key_type;
         typedef _Value value_type;
         typedef _HashFunc hasher;
         typedef _EqualKey key_equal;
-        typedef hash_table<key_type, value_type, hasher, key_equal> _Ht;
+        typedef _Alloc allocator_type;
+        typedef _Lock lock_type;
+        typedef hash_table<key_type, value_type, hasher, key_equal, allocator_type, lock_type> _Ht;
+        typedef typename _Ht::victim_type victim_type;
+        typedef typename _Ht::const_accessor const_accessor;
+        typedef typename _Ht::accessor accessor;
+        typedef typename _Ht::geometry_type geometry_type;
+        typedef typename _Ht::footprint_type footprint_type;
+        typedef SkewMonitor<key_type> skew_monitor;
+        typedef typename skew_monitor::hitter_info hitter_info;
+        typedef LocalEntry<key_type, value_type> local_entry;
+        typedef AsyncCommand<key_type, value_type> command_type;
+#ifndef SHM_STL_NO_DPDK
+        typedef AsyncQueue<key_type, value_type> async_queue;
+#endif
+
+        // The max count of commands applied in a batch by drain()
+        static const uint32 ASYNC_BURST = 32;
+
+        // Called after an entry is evicted in cache mode
+        typedef void (*evict_callback_t)(const key_type &key, const value_type &value, void *arg);
 
     public:
-        hash_map(const char * name, uint32 buckets = DEFAULT_BUCKET_NUM): m_buckets(buckets) {
+        hash_map(const char * name, uint32 buckets = DEFAULT_BUCKET_NUM)
+            : m_buckets(buckets), m_ht(NULL), m_evict_cb(NULL), m_evict_arg(NULL)
+            , m_local_size(0), m_local_mask(0), m_skew(NULL), m_sized(false) {
+                     snprintf(m_name, sizeof(m_name), "HT_%s", name);
+                     memset(m_local_cache, 0, sizeof(m_local_cache));
+                     memset(&m_plan, 0, sizeof(m_plan));
+                     m_geo.buckets = NULL;
+                     m_geo.version = (uint32)-1;
+                 }
+
+        /*
+         * @brief : Size the table for expected entries and at most max_entries, within
+         *          budget bytes (0 means no limit). The primary allocates the buckets
+         *          and their nodes up front in two arrays, so inserts seldom allocate
+         *          memory. See hash_table::plan(), and plan() for the footprint.
+         *          create_or_attach() fails if the budget is too small.
+         * */
+        hash_map(const char * name, uint32 expected, uint32 max_entries, u_int64_t budget)
+            : m_buckets(0), m_ht(NULL), m_evict_cb(NULL), m_evict_arg(NULL)
+            , m_local_size(0), m_local_mask(0), m_skew(NULL), m_sized(true) {
                      snprintf(m_name, sizeof(m_name), "HT_%s", name);
+                     memset(m_local_cache, 0, sizeof(m_local_cache));
+                     if (_Ht::plan(expected, max_entries, budget, &m_plan))
+                         m_buckets = m_plan.buckets;
+                     else
+                         memset(&m_plan, 0, sizeof(m_plan));
+                     m_geo.buckets = NULL;
+                     m_geo.version = (uint32)-1;
                  }
 
         ~hash_map() {
-            if (rte_eal_process_type() == RTE_PROC_PRIMARY)
-                m_ht->~_Ht();
+            disable_local_cache();
 
+            if (_Alloc::process_type() == SHM_PROC_PRIMARY) {
+                if (m_skew)
+                    m_skew->~skew_monitor();
+                if (m_ht)
+                    m_ht->~_Ht();
+            }
+
+            m_skew = NULL;
             m_ht = NULL;
         }
 
         bool create_or_attach(void) {
             uint32 shm_size = sizeof(_Ht);
-            const rte_proc_type_t proc_type = rte_eal_process_type();
+            const proc_type type = _Alloc::process_type();
+
+            if (type == SHM_PROC_PRIMARY && m_sized) {
+                if (m_plan.buckets == 0)
+                    return false;
 
-            if (proc_type == RTE_PROC_PRIMARY) {
-                const struct rte_memzone * zone = rte_memzone_reserve(&m_name[0], shm_size, 0, 
-                                                                      RTE_MEMZONE_SIZE_HINT_ONLY);
+                void * addr = _Alloc::reserve(&m_name[0], shm_size);
+                m_ht = addr ? ::new (addr) _Ht(m_plan) : NULL;
+                if (m_ht && m_ht->capacity() == 0) {
+                    m_ht->~_Ht();
+                    m_ht = NULL;
+                }
+            } else if (type == SHM_PROC_PRIMARY) {
+                void * addr = _Alloc::reserve(&m_name[0], shm_size);
                 // replacement new, call the constructor of hash table
-                m_ht = ::new (zone->addr) _Ht(m_buckets);
-            } else if (proc_type == RTE_PROC_SECONDARY) {
-                const struct rte_memzone * zone = rte_memzone_lookup(&m_name[0]);
-                m_ht = static_cast<_Ht*>(zone->addr);
+                m_ht = addr ? ::new (addr) _Ht(m_buckets) : NULL;
+            } else if (type == SHM_PROC_SECONDARY) {
+                m_ht = static_cast<_Ht*>(_Alloc::lookup(&m_name[0]));
             } else {
                 m_ht = NULL;
             }
 
             if (m_ht) {
+                m_ht->geometry(&m_geo);
                 return true;
             } else {
                 return false;
@@ -87,29 +172,437 @@ class hash_map {
 
         bool find(const key_type &key, value_type * ret = NULL) {
             RETURN_FALSE_IF_NULL(m_ht);
-            return m_ht->find(key, ret);
+            if (m_skew && m_skew->sampling())
+                m_skew->sample(geometry().signature(key), key);
+
+            if (m_local_size == 0)
+                return _Ht::find(geometry(), key, ret);
+
+            return find_local(key, ret);
+        }
+
+        /*
+         * @brief
+         *  Access an entry in place, without copying its value. The accessor holds
+         *  the bucket lock until it is released or destroyed, see hash_table.
+         *  The local cache is not used.
+         * */
+        bool find(const_accessor &acc, const key_type &key) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            return m_ht->find(acc, key);
+        }
+
+        bool find(accessor &acc, const key_type &key) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            return m_ht->find(acc, key);
+        }
+
+        // Find or insert key and hold it by acc, return true if the key is inserted.
+        // In cache mode the evict callback is called before acc is released
+        bool insert(accessor &acc, const key_type &key, const value_type &value) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            if (m_evict_cb == NULL)
+                return m_ht->insert(acc, key, value);
+
+            victim_type victim;
+            bool ret = m_ht->insert(acc, key, value, &victim);
+            if (victim.evicted)
+                m_evict_cb(victim.key, victim.value, m_evict_arg);
+
+            return ret;
         }
 
         bool insert(const key_type &key, const value_type &value) {
             RETURN_FALSE_IF_NULL(m_ht);
-            return m_ht->insert(key, value);
+            if (m_evict_cb == NULL)
+                return _Ht::insert(geometry(), key, value);
+
+            victim_type victim;
+            bool ret = _Ht::insert(geometry(), key, value, &victim);
+            if (victim.evicted)
+                m_evict_cb(victim.key, victim.value, m_evict_arg);
+
+            return ret;
         }
 
         bool erase(const key_type &key, value_type * ret = NULL) {
             RETURN_FALSE_IF_NULL(m_ht);
-            return m_ht->erase(key, ret);
+            return _Ht::erase(geometry(), key, ret);
         }
 
         template <typename _Params, typename _Modifier>
         bool update(const key_type &key, _Params params, _Modifier &update) {
             RETURN_FALSE_IF_NULL(m_ht);
-            return m_ht->update(key, params, update);
+            return _Ht::update(geometry(), key, params, update);
+        }
+
+        /*
+         * @brief
+         *  Insert the key with value if it is absent, otherwise update its value by
+         *  update(old value, value). It replaces find + insert + update with one lock
+         *  and one chain walk, and no other writer can change the key in between.
+         *  If inserted is not NULL, it takes whether the key was inserted.
+         * */
+        template <typename _Modifier>
+        bool upsert(const key_type &key, const value_type &value, _Modifier &update, bool * inserted = NULL) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            if (m_evict_cb == NULL)
+                return _Ht::upsert(geometry(), key, value, update, NULL, inserted);
+
+            victim_type victim;
+            bool ret = _Ht::upsert(geometry(), key, value, update, &victim, inserted);
+            if (victim.evicted)
+                m_evict_cb(victim.key, victim.value, m_evict_arg);
+
+            return ret;
+        }
+
+        // Insert or replace the value of key
+        bool upsert(const key_type &key, const value_type &value, bool * inserted = NULL) {
+            Assignment<value_type> assign;
+            return upsert(key, value, assign, inserted);
+        }
+
+        /*
+         * @brief
+         *  Copy the value of key to ret. If the key is absent, insert it with value
+         *  first, so ret takes value. Return false only if the key is absent and
+         *  cannot be inserted. If inserted is not NULL, it takes whether the key
+         *  was inserted.
+         * */
+        bool find_or_insert(const key_type &key, const value_type &value, value_type * ret, bool * inserted = NULL) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            if (m_evict_cb == NULL)
+                return _Ht::find_or_insert(geometry(), key, value, ret, NULL, inserted);
+
+            victim_type victim;
+            bool found = _Ht::find_or_insert(geometry(), key, value, ret, &victim, inserted);
+            if (victim.evicted)
+                m_evict_cb(victim.key, victim.value, m_evict_arg);
+
+            return found;
+        }
+
+#ifndef SHM_STL_NO_DPDK
+        /*
+         * @brief
+         *  Create or attach the async command queue of this hash map. Changes made
+         *  by insert_async/erase_async/update_async are queued and applied later by
+         *  the writer, which calls drain() in its loop. The writer can be any lcore
+         *  of any process, but only one lcore should drain a hash map at a time.
+         *
+         *  It should be called after create_or_attach().
+         * */
+        bool create_or_attach_async(uint32 queue_size = async_queue::DEFAULT_QUEUE_SIZE) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            return m_async.create_or_attach(m_name, queue_size);
         }
 
+        /*
+         * @brief
+         *  Queue a change and return without waiting for any bucket lock. Return
+         *  false if the queue is full. If reply is not NULL, the command is returned
+         *  through reply with its result after it is applied, see poll_completions().
+         *  cookie is returned with the completion.
+         * */
+        bool insert_async(const key_type &key, const value_type &value,
+                          struct rte_ring * reply = NULL, u_int64_t cookie = 0) {
+            return enqueue_async(ASYNC_INSERT, key, &value, reply, cookie);
+        }
+
+        bool erase_async(const key_type &key, struct rte_ring * reply = NULL, u_int64_t cookie = 0) {
+            return enqueue_async(ASYNC_ERASE, key, NULL, reply, cookie);
+        }
+
+        // The value is passed to the modifier of drain() as the params
+        bool update_async(const key_type &key, const value_type &value,
+                          struct rte_ring * reply = NULL, u_int64_t cookie = 0) {
+            return enqueue_async(ASYNC_UPDATE, key, &value, reply, cookie);
+        }
+
+        /*
+         * @brief
+         *  Apply at most budget queued commands, update commands are applied by
+         *  action. Return the count of applied commands.
+         * */
+        template <typename _Modifier>
+        uint32 drain(uint32 budget, _Modifier &action) {
+            if (m_ht == NULL || !m_async.ready())
+                return 0;
+
+            command_type * cmds[ASYNC_BURST];
+            uint32 total = 0;
+
+            while (total < budget) {
+                uint32 want = (budget - total < ASYNC_BURST) ? (budget - total) : ASYNC_BURST;
+                uint32 cnt = m_async.dequeue(cmds, want);
+                if (cnt == 0)
+                    break;
+
+                if (m_evict_cb) {
+                    victim_type victims[ASYNC_BURST];
+                    m_ht->apply_batch(cmds, cnt, action, victims);
+                    for (uint32 i = 0; i < cnt; ++i) {
+                        if (victims[i].evicted)
+                            m_evict_cb(victims[i].key, victims[i].value, m_evict_arg);
+                    }
+                } else {
+                    m_ht->apply_batch(cmds, cnt, action);
+                }
+
+                for (uint32 i = 0; i < cnt; ++i)
+                    m_async.complete(cmds[i]);
+
+                total += cnt;
+                if (cnt < want)
+                    break;
+            }
+
+            return total;
+        }
+
+        // Apply queued commands, update commands replace the old value
+        uint32 drain(uint32 budget) {
+            Assignment<value_type> assign;
+            return drain(budget, assign);
+        }
+
+        // Copy at most n finished commands of a producer from its reply ring to out
+        uint32 poll_completions(struct rte_ring * reply, command_type * out, uint32 n) {
+            if (!m_async.ready() || reply == NULL)
+                return 0;
+
+            return m_async.poll(reply, out, n);
+        }
+#endif
+
         void clear(void) {
             if (m_ht) m_ht->clear();
         }
 
+        // Remove entries which are not accessed in ttl_ms milliseconds by expire()
+        void enable_expiry(uint32 ttl_ms) {
+            if (m_ht) m_ht->set_ttl(ms_to_ticks(ttl_ms));
+        }
+
+        void disable_expiry(void) {
+            if (m_ht) m_ht->set_ttl(0);
+        }
+
+        /*
+         * @brief
+         *  Work as a cache holding about capacity entries. Insert always succeeds
+         *  by evicting an old entry when the target bucket is full.
+         *
+         *  The cache mode is shared by all processes, but the evict callback is
+         *  per process, it is called by the process which evicts the entry.
+         * */
+        void enable_cache_mode(uint32 capacity) {
+            if (m_ht) m_ht->set_capacity(capacity);
+        }
+
+        void disable_cache_mode(void) {
+            if (m_ht) m_ht->set_capacity(0);
+        }
+
+        /*
+         * @brief
+         *  Reject most lookups of absent keys by a per-bucket Bloom filter, without
+         *  taking the bucket lock or reading any node. It is shared by all processes.
+         * */
+        void enable_filter(void) {
+            if (m_ht) m_ht->set_filter(true);
+        }
+
+        void disable_filter(void) {
+            if (m_ht) m_ht->set_filter(false);
+        }
+
+        // Keep hot entries near the head of their chains, for skewed traffic
+        void enable_reorder(void) {
+            if (m_ht) m_ht->set_reorder(true);
+        }
+
+        void disable_reorder(void) {
+            if (m_ht) m_ht->set_reorder(false);
+        }
+
+        void set_evict_callback(evict_callback_t cb, void * arg = NULL) {
+            m_evict_cb = cb;
+            m_evict_arg = arg;
+        }
+
+        /*
+         * @brief
+         *  Remember recent find results in a small direct-mapped cache per lcore.
+         *  The cache belongs to this handle, a hit is validated by the generation
+         *  of the bucket, which is increased by every writer of any process. So a
+         *  hit never returns a stale value, and does not touch any node.
+         *
+         *  If expiry is enabled, a cached entry is refreshed from the hash table
+         *  once it is older than the touch interval, so hot entries do not expire.
+         *  The cache is allocated on the first find of each lcore.
+         *
+         *  It should be called before any lcore uses this handle.
+         * */
+        void enable_local_cache(uint32 entries_per_lcore) {
+            disable_local_cache();
+
+            if (entries_per_lcore == 0)
+                return;
+
+            if (!is_power_of_2(entries_per_lcore))
+                entries_per_lcore = convert_to_power_of_2(entries_per_lcore);
+
+            m_local_size = entries_per_lcore;
+            m_local_mask = entries_per_lcore - 1;
+        }
+
+        void disable_local_cache(void) {
+            m_local_size = 0;
+            m_local_mask = 0;
+
+            for (uint32 i = 0; i < SHM_MAX_LCORE; ++i) {
+                if (m_local_cache[i]) {
+                    _Alloc::free_private(m_local_cache[i]);
+                    m_local_cache[i] = NULL;
+                }
+            }
+        }
+
+        /*
+         * @brief
+         *  Watch the chain lengths and the hot keys of this table, see SkewMonitor.
+         *  One of 2^sample_shift finds of each lcore is sampled. The monitor is
+         *  created by the primary process in shared memory and secondary processes
+         *  attach to it, so all processes feed and read the same report.
+         *
+         *  It should be called after create_or_attach().
+         * */
+        bool enable_skew_monitor(uint32 sample_shift = 10) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            if (m_skew)
+                return true;
+
+            char name[SHM_NAME_SIZE + 4];
+            snprintf(name, sizeof(name), "%s_SK", m_name);
+
+            const proc_type type = _Alloc::process_type();
+            if (type == SHM_PROC_PRIMARY) {
+                void * addr = _Alloc::reserve(name, sizeof(skew_monitor));
+                m_skew = addr ? ::new (addr) skew_monitor(sample_shift) : NULL;
+            } else if (type == SHM_PROC_SECONDARY) {
+                m_skew = static_cast<skew_monitor *>(_Alloc::lookup(name));
+            }
+
+            return m_skew != NULL;
+        }
+
+        // Stop sampling in this handle, the shared monitor is kept for other processes
+        void disable_skew_monitor(void) {
+            m_skew = NULL;
+        }
+
+        /*
+         * @brief
+         *  Rescan the chain lengths, and halve the hot key counts if age is true.
+         *  It reads every bucket, so it is for a housekeeping lcore.
+         * */
+        void scan_skew(bool age = true) {
+            if (m_ht == NULL || m_skew == NULL)
+                return;
+
+            const geometry_type & geo = geometry();
+            m_skew->scan(geo.buckets, geo.bucket_num);
+            if (age)
+                m_skew->age();
+        }
+
+        // The longest chain found by the last scan_skew()
+        uint32 max_chain_length(void) const {
+            return m_skew ? m_skew->max_length() : 0;
+        }
+
+        // Copy at most max hot keys to out, the hottest first
+        uint32 heavy_hitters(hitter_info * out, uint32 max) const {
+            return m_skew ? m_skew->heavy_hitters(out, max) : 0;
+        }
+
+        void print_skew(void) {
+            std::ostringstream os;
+            if (m_skew) {
+                m_skew->str(os);
+            } else {
+                os << "Skew monitor is not enabled!" << std::endl;
+            }
+
+            std::cout << os.str().c_str() << std::endl;
+        }
+
+        // Write the skew report to os, the caller decides where it goes
+        void log_skew(std::ostream & os) {
+            if (m_skew)
+                m_skew->str(os);
+        }
+
+        /*
+         * @brief
+         *  Defend against keys chosen to fall into one bucket. Bucket indexes are
+         *  mixed with a random seed of the table, which is shared by all processes.
+         *  An insert into a chain longer than max_chain marks the table skewed, and
+         *  rebalance() then moves all entries to the buckets of a new seed.
+         *  max_chain should be well above the average chain length.
+         * */
+        void enable_reseed(uint32 max_chain) {
+            if (m_ht) m_ht->set_chain_limit(max_chain);
+        }
+
+        void disable_reseed(void) {
+            if (m_ht) m_ht->set_chain_limit(0);
+        }
+
+        /*
+         * @brief
+         *  Start a reseed if the table is skewed, and go on with the reseed in
+         *  progress, visiting at most budget buckets and entries. It is for a
+         *  housekeeping lcore, lookups and changes go on meanwhile.
+         *  Return the count of moved entries.
+         * */
+        uint32 rebalance(uint32 budget) {
+            if (m_ht == NULL)
+                return 0;
+
+            if (m_ht->skewed())
+                m_ht->start_reseed();
+
+            return m_ht->reseed(budget);
+        }
+
+        // Start a reseed now whether the table is skewed or not, see rebalance()
+        bool reseed(void) {
+            return m_ht ? m_ht->start_reseed() : false;
+        }
+
+        bool reseeding(void) const {
+            return m_ht ? m_ht->reseeding() : false;
+        }
+
+        // Remove expired entries, visiting at most budget buckets and nodes
+        uint32 expire(uint32 budget) {
+            if (m_ht)
+                return m_ht->expire(budget);
+            else
+                return 0;
+        }
+
+        // Release node memory which is no longer needed, return the count of released nodes
+        uint32 shrink(void) {
+            if (m_ht)
+                return m_ht->shrink();
+            else
+                return 0;
+        }
+
         void print(void) {
             std::ostringstream os;
             if (m_ht) {
@@ -142,10 +635,128 @@ class hash_map {
                 return 0;
         }
 
+        /*
+         * @brief : Insert n entries by the lcores of lcore_mask (bit i is lcore i) in
+         *          parallel, each lcore owns a range of buckets and inserts without
+         *          locks. Lookups wait until all entries are in. Return the count of
+         *          inserted entries, see hash_table::build().
+         * */
+        uint32 build_parallel(const key_type * keys, const value_type * values, uint32 n, u_int64_t lcore_mask) {
+            return m_ht ? m_ht->build(keys, values, n, lcore_mask) : 0;
+        }
+
+        // The footprint planned by the sizing constructor, all zero if it is not used or fails
+        const footprint_type & plan(void) const {return m_plan;}
+
+        // The memory the table takes now, false if it is not created
+        bool footprint(footprint_type * out) const {
+            if (m_ht == NULL)
+                return false;
+
+            m_ht->footprint(out);
+            return true;
+        }
+
+    private:
+        // The copy of table geometry, it is refreshed only when the table changes
+        // its settings, see hash_table::geometry_type
+        const geometry_type & geometry(void) {
+            uint32 version = m_ht->geometry_version();
+            if (version != m_geo.version) {
+                m_ht->geometry(&m_geo);
+                // A change during the copy is picked up by the next call
+                m_geo.version = version;
+            }
+
+            return m_geo;
+        }
+
+        // Get the local cache of current lcore, NULL for non-EAL threads
+        local_entry * local_cache(void) {
+            uint32 lcore = current_lcore();
+            if (lcore >= SHM_MAX_LCORE)
+                return NULL;
+
+            if (m_local_cache[lcore] == NULL) {
+                std::ostringstream name;
+                name << m_name << "_local_" << lcore;
+                m_local_cache[lcore] = static_cast<local_entry *>(_Alloc::zmalloc_private(name.str().c_str(),
+                                                   m_local_size * sizeof(local_entry), SHM_CACHE_LINE_SIZE));
+            }
+
+            return m_local_cache[lcore];
+        }
+
+#ifndef SHM_STL_NO_DPDK
+        bool enqueue_async(u_int32_t op, const key_type &key, const value_type * value,
+                           struct rte_ring * reply, u_int64_t cookie) {
+            RETURN_FALSE_IF_NULL(m_ht);
+            if (!m_async.ready())
+                return false;
+
+            command_type * cmd = m_async.alloc();
+            RETURN_FALSE_IF_NULL(cmd);
+
+            cmd->op = op;
+            cmd->sig = m_ht->signature(key);
+            cmd->result = false;
+            cmd->cookie = cookie;
+            cmd->reply = reply;
+            cmd->key = key;
+            if (value)
+                cmd->value = *value;
+
+            return m_async.enqueue(cmd);
+        }
+#endif
+
+        bool find_local(const key_type &key, value_type * ret) {
+            const geometry_type & geo = geometry();
+            local_entry * cache = local_cache();
+            if (cache == NULL)
+                return _Ht::find(geo, key, ret);
+
+            sig_t sig = geo.signature(key);
+            local_entry &entry = cache[(sig ^ (sig >> 16)) & m_local_mask];
+            uint32 gap = geo.touch_gap;
+
+            if (entry.valid && entry.sig == sig && m_equal_to(entry.key, key)
+                    && entry.gen == geo.buckets[entry.bucket].generation()
+                    && (gap == 0 || coarse_ticks() - entry.stamp < gap)) {
+                if (entry.found && ret)
+                    *ret = entry.value;
+                return entry.found;
+            }
+
+            // Miss, fill this entry from the hash table
+            entry.found = _Ht::lookup(geo, sig, key, &entry.value, &entry.gen, &entry.bucket);
+            entry.sig = sig;
+            entry.key = key;
+            entry.stamp = gap ? coarse_ticks() : 0;
+            entry.valid = true;
+
+            if (entry.found && ret)
+                *ret = entry.value;
+            return entry.found;
+        }
+
     private:
         uint32 m_buckets;
-        char   m_name[SHM_NAME_SIZE];
+        char   m_name[SHM_NAME_SIZE + 1];  // a longer name is kept long enough to be rejected by _Alloc
         _Ht *  m_ht;
+        evict_callback_t m_evict_cb;
+        void * m_evict_arg;
+        key_equal m_equal_to;
+        uint32 m_local_size;  // entries of the local cache per lcore, 0 means it is disabled
+        uint32 m_local_mask;
+        local_entry * m_local_cache[SHM_MAX_LCORE];
+        geometry_type m_geo;  // the copy of table geometry
+        skew_monitor * m_skew;  // in shared memory, NULL if it is not enabled
+        bool   m_sized;         // constructed with a plan, see plan()
+        footprint_type m_plan;
+#ifndef SHM_STL_NO_DPDK
+        async_queue m_async;
+#endif
 };
 
 #undef SHM_NAME_SIZE
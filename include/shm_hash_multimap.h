@@ -0,0 +1,180 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_HASH_MULTIMAP_H_
+#define __SHM_HASH_MULTIMAP_H_
+
+#include "shm_hash_table.h"
+
+#include <iostream>
+#include <sstream>
+#include <sys/types.h>
+
+#define SHM_NAME_SIZE 32
+
+__SHM_STL_BEGIN
+
+/*
+ * @brief : A fixed size array of values, it is the value of a multimap node
+ * */
+template <typename _Item, uint32 _Size>
+class ValueBlock {
+    public:
+        typedef _Item item_type;
+        static const uint32 CAPACITY = _Size;
+
+        ValueBlock() : m_count(0) {}
+
+        uint32 size(void) const {return m_count;}
+        bool full(void) const {return m_count == CAPACITY;}
+
+        // The caller makes sure the block is not full or empty
+        void push(const item_type &item) {m_items[m_count++] = item;}
+        void pop(void) {--m_count;}
+
+        const item_type & operator[] (uint32 i) const {return m_items[i];}
+        item_type & operator[] (uint32 i) {return m_items[i];}
+
+    private:
+        uint32    m_count;
+        item_type m_items[_Size];
+};
+
+template <typename _Item, uint32 _Size>
+ostream & operator<< (ostream &os, const ValueBlock<_Item, _Size> &block) {
+    return os << block.size() << " values";
+}
+
+/*
+ * @brief : hash_multimap maps a key to many values.
+ *
+ *          The values of a key are stored in blocks of _BlockSize values. The
+ *          first block is a node of the bucket chain, the overflow blocks are
+ *          nodes from the same node pool, linked right after it. So find_all()
+ *          reads the values of a key in one sequential scan, and entries in
+ *          capacity() and used_entries() are blocks.
+ *
+ *          Expiry and cache mode are not supported, they work on single nodes
+ *          and would split the values of a key.
+ * */
+template <typename _Key, typename _Value, uint32 _BlockSize = 4, typename _HashFunc = hash<_Key>,
+          typename _EqualKey = std::equal_to<_Key>, typename _EqualValue = std::equal_to<_Value>,
+          typename _Alloc = default_alloc, typename _Lock = rwlock>
+class hash_multimap {
+    public:
+        typedef _Key key_type;
+        typedef _Value value_type;
+        typedef _HashFunc hasher;
+        typedef _EqualKey key_equal;
+        typedef _EqualValue value_equal;
+        typedef _Alloc allocator_type;
+        typedef _Lock lock_type;
+        typedef ValueBlock<value_type, _BlockSize> block_type;
+        typedef hash_table<key_type, block_type, hasher, key_equal, allocator_type, lock_type> _Ht;
+
+    public:
+        hash_multimap(const char * name, uint32 buckets = DEFAULT_BUCKET_NUM)
+            : m_buckets(buckets), m_ht(NULL) {
+                snprintf(m_name, sizeof(m_name), "HM_%s", name);
+            }
+
+        ~hash_multimap() {
+            if (m_ht && _Alloc::process_type() == SHM_PROC_PRIMARY)
+                m_ht->~_Ht();
+
+            m_ht = NULL;
+        }
+
+        bool create_or_attach(void) {
+            const proc_type type = _Alloc::process_type();
+
+            if (type == SHM_PROC_PRIMARY) {
+                void * addr = _Alloc::reserve(&m_name[0], sizeof(_Ht));
+                m_ht = addr ? ::new (addr) _Ht(m_buckets) : NULL;
+            } else if (type == SHM_PROC_SECONDARY) {
+                m_ht = static_cast<_Ht*>(_Alloc::lookup(&m_name[0]));
+            } else {
+                m_ht = NULL;
+            }
+
+            return m_ht != NULL;
+        }
+
+        // Add a value to key, duplicated values are allowed
+        bool insert(const key_type &key, const value_type &value) {
+            return m_ht ? m_ht->append(key, value) : false;
+        }
+
+        /*
+         * @brief
+         *  Copy at most max values of key to out. Return the count of values of
+         *  key, which may be larger than max.
+         * */
+        uint32 find_all(const key_type &key, value_type * out, uint32 max) const {
+            return m_ht ? m_ht->find_all(key, out, max) : 0;
+        }
+
+        uint32 count(const key_type &key) const {
+            return m_ht ? m_ht->find_all(key, (value_type *)NULL, 0) : 0;
+        }
+
+        // Remove one value of key which equals to value, the order of values may change
+        bool erase_one(const key_type &key, const value_type &value) {
+            return m_ht ? m_ht->erase_value(key, value, m_value_equal) : false;
+        }
+
+        // Remove all values of key, return the count of removed values
+        uint32 erase(const key_type &key) {
+            return m_ht ? m_ht->erase_all(key) : 0;
+        }
+
+        void clear(void) {
+            if (m_ht) m_ht->clear();
+        }
+
+        uint32 shrink(void) {
+            return m_ht ? m_ht->shrink() : 0;
+        }
+
+        void print(void) {
+            std::ostringstream os;
+            if (m_ht) {
+                m_ht->str(os);
+            } else {
+                os << "Hash multimap is not created!" << std::endl;
+            }
+
+            std::cout << os.str().c_str() << std::endl;
+        }
+
+        uint32 capacity(void) const {return m_ht ? m_ht->capacity() : 0;}
+        uint32 free_entries(void) const {return m_ht ? m_ht->free_entries() : 0;}
+        uint32 used_entries(void) const {return m_ht ? m_ht->used_entries() : 0;}
+
+    private:
+        uint32 m_buckets;
+        char   m_name[SHM_NAME_SIZE + 1];  // a longer name is kept long enough to be rejected by _Alloc
+        _Ht *  m_ht;
+        value_equal m_value_equal;
+};
+
+#undef SHM_NAME_SIZE
+
+__SHM_STL_END
+
+#endif
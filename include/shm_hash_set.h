@@ -0,0 +1,230 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_HASH_SET_H_
+#define __SHM_HASH_SET_H_
+
+#include "shm_hash_table.h"
+
+#include <iostream>
+#include <sstream>
+#include <sys/types.h>
+
+#define SHM_NAME_SIZE 32
+
+__SHM_STL_BEGIN
+
+/*
+ * @brief : hash_set is the per-process handle of a shared set of keys.
+ *
+ *          It uses the same hash table as hash_map with empty_value as the value
+ *          type, so a node only holds the link, the signature and the key.
+ *          Sets and maps live in separate name spaces, "HS_<name>" and "HT_<name>".
+ * */
+template <typename _Key, typename _HashFunc = hash<_Key>, typename _EqualKey = std::equal_to<_Key>,
+          typename _Alloc = default_alloc, typename _Lock = rwlock>
+class hash_set {
+    public:
+        typedef _Key key_type;
+        typedef _Key value_type;
+        typedef _HashFunc hasher;
+        typedef _EqualKey key_equal;
+        typedef _Alloc allocator_type;
+        typedef _Lock lock_type;
+        typedef hash_table<key_type, empty_value, hasher, key_equal, allocator_type, lock_type> _Ht;
+
+        // Keys of a bulk call are hashed and their buckets are prefetched in groups
+        static const uint32 BULK_BURST = 32;
+
+    public:
+        hash_set(const char * name, uint32 buckets = DEFAULT_BUCKET_NUM)
+            : m_buckets(buckets), m_ht(NULL) {
+                snprintf(m_name, sizeof(m_name), "HS_%s", name);
+            }
+
+        ~hash_set() {
+            if (m_ht && _Alloc::process_type() == SHM_PROC_PRIMARY)
+                m_ht->~_Ht();
+
+            m_ht = NULL;
+        }
+
+        bool create_or_attach(void) {
+            const proc_type type = _Alloc::process_type();
+
+            if (type == SHM_PROC_PRIMARY) {
+                void * addr = _Alloc::reserve(&m_name[0], sizeof(_Ht));
+                m_ht = addr ? ::new (addr) _Ht(m_buckets) : NULL;
+            } else if (type == SHM_PROC_SECONDARY) {
+                m_ht = static_cast<_Ht*>(_Alloc::lookup(&m_name[0]));
+            } else {
+                m_ht = NULL;
+            }
+
+            return m_ht != NULL;
+        }
+
+        bool contains(const key_type &key) const {
+            return m_ht ? m_ht->find(key) : false;
+        }
+
+        // Return false if the key is already in this set or there is no free node
+        bool insert(const key_type &key) {
+            return m_ht ? m_ht->insert(key, empty_value()) : false;
+        }
+
+        bool erase(const key_type &key) {
+            return m_ht ? m_ht->erase(key) : false;
+        }
+
+        /*
+         * @brief
+         *  Bulk variants. Each takes n keys, the result of keys[i] is stored in
+         *  results[i] if results is not NULL. Return the count of keys found,
+         *  inserted or erased.
+         * */
+        uint32 contains_bulk(const key_type * keys, uint32 n, bool * results = NULL) const {
+            return bulk(BULK_LOOKUP, keys, n, results);
+        }
+
+        uint32 insert_bulk(const key_type * keys, uint32 n, bool * results = NULL) {
+            return bulk(BULK_INSERT, keys, n, results);
+        }
+
+        uint32 erase_bulk(const key_type * keys, uint32 n, bool * results = NULL) {
+            return bulk(BULK_ERASE, keys, n, results);
+        }
+
+        void clear(void) {
+            if (m_ht) m_ht->clear();
+        }
+
+        // Remove keys which are not looked up in ttl_ms milliseconds by expire()
+        void enable_expiry(uint32 ttl_ms) {
+            if (m_ht) m_ht->set_ttl(ms_to_ticks(ttl_ms));
+        }
+
+        void disable_expiry(void) {
+            if (m_ht) m_ht->set_ttl(0);
+        }
+
+        // Keep hot keys near the head of their chains, for skewed traffic
+        void enable_reorder(void) {
+            if (m_ht) m_ht->set_reorder(true);
+        }
+
+        void disable_reorder(void) {
+            if (m_ht) m_ht->set_reorder(false);
+        }
+
+        uint32 expire(uint32 budget) {
+            return m_ht ? m_ht->expire(budget) : 0;
+        }
+
+        uint32 shrink(void) {
+            return m_ht ? m_ht->shrink() : 0;
+        }
+
+        /*
+         * @brief
+         *  Reject most lookups of absent keys by a per-bucket Bloom filter, without
+         *  taking the bucket lock or reading any node. It is shared by all processes.
+         * */
+        void enable_filter(void) {
+            if (m_ht) m_ht->set_filter(true);
+        }
+
+        void disable_filter(void) {
+            if (m_ht) m_ht->set_filter(false);
+        }
+
+        void print(void) {
+            std::ostringstream os;
+            if (m_ht) {
+                m_ht->str(os);
+            } else {
+                os << "Hash set is not created!" << std::endl;
+            }
+
+            std::cout << os.str().c_str() << std::endl;
+        }
+
+        uint32 capacity(void) const {return m_ht ? m_ht->capacity() : 0;}
+        uint32 free_entries(void) const {return m_ht ? m_ht->free_entries() : 0;}
+        uint32 used_entries(void) const {return m_ht ? m_ht->used_entries() : 0;}
+
+    private:
+        enum BulkOp {
+            BULK_LOOKUP = 0,
+            BULK_INSERT,
+            BULK_ERASE
+        };
+
+        // Hash a group of keys and prefetch their buckets first, so the bucket
+        // misses of the group overlap instead of being paid one by one
+        uint32 bulk(BulkOp op, const key_type * keys, uint32 n, bool * results) const {
+            if (m_ht == NULL)
+                return 0;
+
+            sig_t sigs[BULK_BURST];
+            uint32 done = 0;
+
+            for (uint32 base = 0; base < n; base += BULK_BURST) {
+                uint32 cnt = (n - base < BULK_BURST) ? (n - base) : BULK_BURST;
+
+                for (uint32 i = 0; i < cnt; ++i) {
+                    sigs[i] = m_ht->signature(keys[base + i]);
+                    m_ht->prefetch(sigs[i]);
+                }
+
+                for (uint32 i = 0; i < cnt; ++i) {
+                    const key_type &key = keys[base + i];
+                    bool ret = false;
+                    switch (op) {
+                        case BULK_LOOKUP:
+                            ret = m_ht->lookup(sigs[i], key, NULL, NULL);
+                            break;
+                        case BULK_INSERT:
+                            ret = m_ht->insert_hashed(sigs[i], key, empty_value());
+                            break;
+                        case BULK_ERASE:
+                            ret = m_ht->erase_hashed(sigs[i], key);
+                            break;
+                    }
+
+                    if (results)
+                        results[base + i] = ret;
+                    if (ret)
+                        ++done;
+                }
+            }
+
+            return done;
+        }
+
+    private:
+        uint32 m_buckets;
+        char   m_name[SHM_NAME_SIZE + 1];  // a longer name is kept long enough to be rejected by _Alloc
+        _Ht *  m_ht;
+};
+
+#undef SHM_NAME_SIZE
+
+__SHM_STL_END
+
+#endif
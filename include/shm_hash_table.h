@@ -23,12 +23,12 @@
 #include <memory.h>
 #include <iostream>
 #include <sstream>
-#include <rte_malloc.h>
-#include <rte_eal.h>
-#include <rte_rwlock.h>
+#include <algorithm>
 #include "shm_hash_fun.h"
 #include "shm_common.h"
+#include "shm_allocator.h"
 #include "shm_bucket.h"
+#include "shm_async_queue.h"
 
 using std::ostream;
     
@@ -41,7 +41,27 @@ struct Assignment {
     }
 };
 
-template <typename _Key, typename _Value, typename _HashFunc = hash<_Key>, typename _EqualKey = std::equal_to<_Key> >
+// The bucket of a signature under a seed. The seed is random, so the owners of
+// keys cannot choose keys which fall into one bucket
+inline uint32
+bucket_index(sig_t sig, uint32 seed, uint32 mask) {
+    return shm_hash_mix32(sig, seed) & mask;
+}
+
+// Order commands by bucket index
+template <typename _Command>
+struct BucketLess {
+    BucketLess(uint32 seed, uint32 mask) : m_seed(seed), m_mask(mask) {}
+    bool operator() (const _Command * a, const _Command * b) const {
+        return bucket_index(a->sig, m_seed, m_mask) < bucket_index(b->sig, m_seed, m_mask);
+    }
+
+    uint32 m_seed;
+    uint32 m_mask;
+};
+
+template <typename _Key, typename _Value, typename _HashFunc = hash<_Key>, typename _EqualKey = std::equal_to<_Key>,
+          typename _Alloc = default_alloc, typename _Lock = rwlock>
 class hash_table {
     public:
         typedef Node<_Key, _Value> node_type;
@@ -49,23 +69,216 @@ class hash_table {
         typedef _Value value_type;
         typedef _HashFunc hasher;
         typedef _EqualKey key_equal;
-        typedef NodePool<node_type> node_pool_t;
-        typedef Bucket<node_type, key_type, value_type, key_equal>  bucket_type;
+        typedef _Alloc allocator_type;
+        typedef _Lock lock_type;
+        typedef NodePool<node_type, allocator_type> node_pool_t;
+        typedef Bucket<node_type, key_type, value_type, key_equal, allocator_type, lock_type>  bucket_type;
+        typedef typename bucket_type::victim_t victim_type;
+
+    public:
+        /*
+         * @brief
+         *  An accessor refers to an entry in place and holds the lock of its bucket
+         *  until it is released or destroyed, const_accessor holds the read lock and
+         *  accessor holds the write lock. The value is read or modified without
+         *  copies, so it suits large values.
+         *
+         *  An accessor should be released soon, and its owner must not access
+         *  other entries of the same table before that, they may be in the same bucket.
+         * */
+        class const_accessor {
+            friend class hash_table;
+            public:
+                const_accessor() : m_bucket(NULL), m_node(NULL), m_write(false) {}
+                ~const_accessor() {release();}
+
+                bool empty(void) const {return m_node == NULL;}
+                const key_type & key(void) const {return m_node->key();}
+                const value_type & operator* (void) const {return m_node->value();}
+                const value_type * operator-> (void) const {return &m_node->value();}
+
+                void release(void) {
+                    if (m_bucket) {
+                        m_bucket->release(m_write);
+                        m_bucket = NULL;
+                        m_node = NULL;
+                    }
+                }
+
+            protected:
+                bucket_type * m_bucket;
+                node_type *   m_node;
+                bool          m_write;
+
+            private:
+                const_accessor(const const_accessor &);
+                const_accessor & operator= (const const_accessor &);
+        };
+
+        class accessor : public const_accessor {
+            public:
+                value_type & operator* (void) const {return this->m_node->value();}
+                value_type * operator-> (void) const {return &this->m_node->value();}
+        };
+
+        /*
+         * @brief
+         *  The read-mostly state which lookups and changes depend on. A handle keeps
+         *  a copy of it and calls the static methods with the copy, so a call does
+         *  not load the table header except version, which only changes with the
+         *  settings. The copy is refreshed when version changes.
+         * */
+        struct geometry_type {
+            hasher        hash_func;
+            bucket_type * buckets;
+            uint32        bucket_num;
+            uint32        mask;
+            uint32        ttl;           // expiry time in coarse ticks, 0 means expiry is disabled
+            uint32        touch_gap;     // the min interval to refresh the access time of a node
+            uint32        bucket_limit;  // max entries per bucket in cache mode, 0 means cache mode is disabled
+            uint32        use_filter;    // lookups check the bucket filter first if it is not zero
+            uint32        chain_limit;   // a longer chain marks the table skewed, 0 means no check
+            uint32        secret;        // random, the seed of each round is derived from it
+            volatile uint32 epoch;       // twice the rounds of reseed, odd while a reseed is in progress
+            hash_table *  table;         // the shared table, its geometry is used after a reseed
+            volatile uint32 version;     // increased by every change of the fields above
+
+            // The seed of bucket index in a round of reseed
+            uint32 seed(uint32 round) const {return secret + round * 0x9E3779B9U;}
+
+            // The signature of a key, it is seeded by the secret and never changes
+            sig_t signature(const key_type & key) const {return seeded_hash(hash_func, key, secret);}
+        };
+
+        /*
+         * @brief
+         *  The memory of a table in bytes. plan() fills it for a table sized up
+         *  front, footprint() reports what a table takes now.
+         * */
+        struct footprint_type {
+            uint32    buckets;
+            uint32    nodes_per_bucket;  // the nodes of each bucket allocated up front
+            u_int64_t table_bytes;       // the table header
+            u_int64_t bucket_bytes;      // the bucket array
+            u_int64_t arena_bytes;       // the nodes allocated up front, in one array
+            u_int64_t grown_bytes;       // the node lists allocated on demand
+            u_int64_t total_bytes;
+            u_int64_t budget;            // 0 means no limit
+        };
+
+        static const uint32 PLANNED_LOAD = 4;  // expected entries per bucket of a table sized by plan()
+        static const uint32 PEEK_SLACK = 16;   // the extra nodes peek() walks over the bucket size
 
     public:
-        hash_table(uint32 buckets = DEFAULT_BUCKET_NUM)
-            : m_mask(0), m_bucket_num(buckets), m_bucket_array(NULL) {
+        // secret seeds the signatures, 0 picks a random one
+        hash_table(uint32 buckets = DEFAULT_BUCKET_NUM, uint32 secret = 0)
+            : m_expire_cursor(0), m_reseed_cursor(0), m_skewed(0)
+            , m_arena(NULL), m_arena_nodes(0), m_allowance(0), m_budget(0) {
+                m_geo.buckets = NULL;
+                m_geo.bucket_num = buckets;
+                m_geo.mask = 0;
+                m_geo.ttl = 0;
+                m_geo.touch_gap = 0;
+                m_geo.bucket_limit = 0;
+                m_geo.use_filter = 0;
+                m_geo.chain_limit = 0;
+                m_geo.secret = secret ? secret : random_seed();
+                m_geo.epoch = 0;
+                m_geo.table = this;
+                m_geo.version = 0;
+                m_reseed_lock.init();
+                initialize();
+            }
+
+        // Allocate a table sized by plan() up front
+        hash_table(const footprint_type & plan)
+            : m_expire_cursor(0), m_reseed_cursor(0), m_skewed(0)
+            , m_arena(NULL), m_arena_nodes(plan.nodes_per_bucket), m_budget(plan.budget) {
+                m_geo.buckets = NULL;
+                m_geo.bucket_num = plan.buckets;
+                m_geo.mask = 0;
+                m_geo.ttl = 0;
+                m_geo.touch_gap = 0;
+                m_geo.bucket_limit = 0;
+                m_geo.use_filter = 0;
+                m_geo.chain_limit = 0;
+                m_geo.secret = random_seed();
+                m_geo.epoch = 0;
+                m_geo.table = this;
+                m_geo.version = 0;
+                m_reseed_lock.init();
+                m_allowance = plan.budget ? (int64_t)(plan.budget - plan.total_bytes) : 0;
                 initialize();
             }
 
         ~hash_table(void) {finalize();}
 
-        bool insert(const key_type & key, const value_type & value) {
-            sig_t sig = m_hash_func(key);
-            bucket_type * bucket = get_bucket_by_sig(sig);
+        /*
+         * @brief
+         *  Size a table for expected entries and at most max_entries within budget
+         *  bytes. There are enough buckets for short chains at expected entries.
+         *  Each bucket gets its share of max_entries and a quarter more nodes up
+         *  front, or less spare nodes if the budget is tight. The rest of the
+         *  budget is left for the buckets which need more nodes than they have.
+         *
+         *  Return false if the budget can not hold max_entries nodes, 0 means no limit.
+         * */
+        static bool plan(uint32 expected, uint32 max_entries, u_int64_t budget, footprint_type * out) {
+            if (expected == 0 || max_entries < expected)
+                return false;
+
+            uint32 buckets = div_roundup(expected, PLANNED_LOAD);
+            if (!is_power_of_2(buckets))
+                buckets = convert_to_power_of_2(buckets);
+
+            uint32 share = div_roundup(max_entries, buckets);
+            uint32 nodes = share + share / 4 + 1;
+
+            out->buckets = buckets;
+            out->table_bytes = sizeof(hash_table);
+            out->bucket_bytes = (u_int64_t)buckets * sizeof(bucket_type);
+            out->grown_bytes = 0;
+            out->budget = budget;
+
+            u_int64_t fixed = out->table_bytes + out->bucket_bytes;
+            u_int64_t per_node = (u_int64_t)buckets * sizeof(node_type);
+            if (budget && fixed + per_node * nodes > budget) {
+                if (fixed + per_node * share > budget)
+                    return false;
+
+                nodes = (budget - fixed) / per_node;
+            }
 
-            // Put node to bucket
-            return bucket->put(sig, key, value);
+            out->nodes_per_bucket = nodes;
+            out->arena_bytes = per_node * nodes;
+            out->total_bytes = fixed + out->arena_bytes;
+            return true;
+        }
+
+        // The memory this table takes now, it walks all buckets
+        void footprint(footprint_type * out) const {
+            out->buckets = m_geo.bucket_num;
+            out->nodes_per_bucket = m_arena_nodes;
+            out->table_bytes = sizeof(hash_table);
+            out->bucket_bytes = (u_int64_t)m_geo.bucket_num * sizeof(bucket_type);
+            out->arena_bytes = (u_int64_t)m_geo.bucket_num * m_arena_nodes * sizeof(node_type);
+            out->grown_bytes = (u_int64_t)capacity() * sizeof(node_type) - out->arena_bytes;
+            out->total_bytes = out->table_bytes + out->bucket_bytes + out->arena_bytes + out->grown_bytes;
+            out->budget = m_budget;
+        }
+
+        /*
+         * @brief
+         *  Insert a new entry. In cache mode an old entry may be evicted to make
+         *  room for it, the evicted entry is copied to victim if it is not NULL.
+         * */
+        bool insert(const key_type & key, const value_type & value, victim_type * victim = NULL) {
+            return insert(m_geo, key, value, victim);
+        }
+
+        static bool insert(const geometry_type & geo, const key_type & key, const value_type & value,
+                           victim_type * victim = NULL) {
+            return put(geo, geo.signature(key), key, value, victim);
         }
 
         /*
@@ -75,72 +288,622 @@ class hash_table {
          *  ret is an output parameter to take the value if the key is in the hash table
          * */
         bool find(const key_type & key, value_type * ret = NULL) const {
-            // Get bucket
-            sig_t sig = m_hash_func(key);
+            return find(m_geo, key, ret);
+        }
+
+        static bool find(const geometry_type & geo, const key_type & key, value_type * ret) {
+            return lookup(geo, geo.signature(key), key, ret, NULL);
+        }
+
+        // Find key and hold the read lock of its bucket by acc, return false if not found
+        bool find(const_accessor & acc, const key_type & key) const {
+            return acquire(acc, key, false);
+        }
+
+        // Find key and hold the write lock of its bucket by acc, return false if not found
+        bool find(accessor & acc, const key_type & key) {
+            return acquire(acc, key, true);
+        }
+
+        /*
+         * @brief
+         *  Find key or insert it with value, and hold the write lock of its bucket
+         *  by acc. Return true if the key is inserted. acc is empty if the key is
+         *  absent and cannot be inserted.
+         * */
+        bool insert(accessor & acc, const key_type & key, const value_type & value, victim_type * victim = NULL) {
+            acc.release();
+
+            sig_t sig = m_geo.signature(key);
+            bucket_type * bucket = lock_bucket(m_geo, sig);
+            bool inserted = false;
+            acc.m_node = bucket->find_or_put_nolock(sig, key, value, now(), m_geo.bucket_limit, victim, &inserted);
+            check_chain(m_geo, bucket);
+            if (acc.m_node) {
+                acc.m_bucket = bucket;
+                acc.m_write = true;
+            } else {
+                bucket->write_unlock();
+            }
+
+            return inserted;
+        }
+
+        sig_t signature(const key_type & key) const {return m_geo.signature(key);}
+
+        // Copy the geometry to a handle, see geometry_type
+        void geometry(geometry_type * geo) const {*geo = m_geo;}
+        uint32 geometry_version(void) const {return m_geo.version;}
+
+        // Prefetch the bucket of a signature before a lookup or a change
+        void prefetch(const sig_t sig) const {prefetch0(get_bucket_by_sig(sig));}
+
+        // insert() and erase() by a signature computed by signature()
+        bool insert_hashed(const sig_t sig, const key_type & key, const value_type & value,
+                           victim_type * victim = NULL) {
+            return put(m_geo, sig, key, value, victim);
+        }
+
+        bool erase_hashed(const sig_t sig, const key_type & key, value_type * ret = NULL) {
+            return remove(m_geo, sig, key, ret);
+        }
+
+        /*
+         * @brief
+         *  Lookup by a signature computed by signature(). gen and index take the
+         *  generation and the index of the bucket the result belongs to, the result
+         *  is still valid as long as that bucket has the same generation. A reseed
+         *  changes the generation of every bucket.
+         * */
+        bool lookup(const sig_t sig, const key_type & key, value_type * ret, uint32 * gen,
+                    uint32 * index = NULL) const {
+            return lookup(m_geo, sig, key, ret, gen, index);
+        }
+
+        static bool lookup(const geometry_type & geo, const sig_t sig, const key_type & key,
+                           value_type * ret, uint32 * gen, uint32 * index = NULL) {
+            const geometry_type * g = &geo;
+            for ( ; ; ) {
+                uint32 limit;
+                bucket_type * bucket = locate(g, sig, &limit);
+                bool found = false;
+
+                // Most misses are rejected by the filter without taking the lock
+                if (g->use_filter) {
+                    // The generation is read before the filter, so a miss is invalidated
+                    // by any insert after it
+                    if (gen) *gen = bucket->generation();
+                    compiler_barrier();
+                    if (bucket->may_contain(sig))
+                        found = bucket->lookup(sig, key, ret, g->touch_gap, gen);
+                } else {
+                    found = bucket->lookup(sig, key, ret, g->touch_gap, gen);
+                }
+
+                // A miss is final unless the bucket was rehashed meanwhile
+                if (found || settled(bucket, limit)) {
+                    if (index) *index = bucket - g->buckets;
+                    return found;
+                }
+            }
+        }
+
+        uint32 generation(const sig_t sig) const {
+            const geometry_type * g = &m_geo;
+            uint32 limit;
+            return locate(g, sig, &limit)->generation();
+        }
+
+        /*
+         * @brief
+         *  Changes by the only writer of the table, the owner, without bucket locks.
+         *  Other threads must not change the table meanwhile. They read it by peek()
+         *  and check a sequence which the owner increases around every change, see
+         *  sharded_hash_map. The owner may also clear() the table inside such a
+         *  sequence window, readers retry as for any other change. The table must
+         *  not be reseeded, expired or shrunk while it has an owner, those walk or
+         *  free nodes outside the window of the owner.
+         * */
+        bool owner_insert(const sig_t sig, const key_type & key, const value_type & value,
+                          victim_type * victim = NULL) {
             bucket_type * bucket = get_bucket_by_sig(sig);
+            bool ret = bucket->put_nolock(sig, key, value, now(), m_geo.bucket_limit, victim);
+            check_chain(m_geo, bucket);
+            return ret;
+        }
 
-            // Search in this bucket
-            return bucket->lookup(sig, key, ret); 
+        bool owner_erase(const sig_t sig, const key_type & key, value_type * ret = NULL) {
+            return get_bucket_by_sig(sig)->remove_nolock(sig, key, ret);
         }
 
+        template <typename _Params, typename _Modifier>
+        bool owner_update(const sig_t sig, const key_type & key, _Params & params, _Modifier &action) {
+            return get_bucket_by_sig(sig)->update_nolock(sig, key, params, action, now());
+        }
+
+        // Lookup without the lock, the result is valid if the owner made no change meanwhile
+        bool peek(const sig_t sig, const key_type & key, value_type * ret) const {
+            const bucket_type * bucket = get_bucket_by_sig(sig);
+            return bucket->peek(sig, key, ret, bucket->size() + PEEK_SLACK);
+        }
+
+        // The min interval in ticks to refresh the access time of an entry, 0 if expiry is disabled
+        uint32 touch_gap(void) const {return m_geo.touch_gap;}
+
         bool erase(const key_type &key, value_type * ret = NULL) {
-            // Get bucket
-            sig_t sig = m_hash_func(key);
-            bucket_type * bucket = get_bucket_by_sig(sig);
+            return erase(m_geo, key, ret);
+        }
 
-            return bucket->remove(sig, key, ret);
+        static bool erase(const geometry_type & geo, const key_type &key, value_type * ret) {
+            return remove(geo, geo.signature(key), key, ret);
         }
 
         // Update the value
         template <typename _Params, typename _Modifier>
         bool update(const key_type & key, _Params & params, _Modifier &action) {
-            sig_t sig = m_hash_func(key);
-            bucket_type * bucket = get_bucket_by_sig(sig);
+            return update(m_geo, key, params, action);
+        }
+
+        template <typename _Params, typename _Modifier>
+        static bool update(const geometry_type & geo, const key_type & key, _Params & params, _Modifier &action) {
+            return modify(geo, geo.signature(key), key, params, action);
+        }
+
+        /*
+         * @brief
+         *  Insert the key if it is absent, otherwise update its value by
+         *  action(old value, value). It is atomic, see Bucket::upsert().
+         * */
+        template <typename _Modifier>
+        bool upsert(const key_type & key, const value_type & value, _Modifier &action,
+                    victim_type * victim = NULL, bool * inserted = NULL) {
+            return upsert(m_geo, key, value, action, victim, inserted);
+        }
+
+        template <typename _Modifier>
+        static bool upsert(const geometry_type & geo, const key_type & key, const value_type & value,
+                           _Modifier &action, victim_type * victim, bool * inserted) {
+            sig_t sig = geo.signature(key);
+            bucket_type * bucket = lock_bucket(geo, sig);
+            bool ret = bucket->upsert_nolock(sig, key, value, action, now(geo), geo.bucket_limit, victim, inserted);
+            check_chain(geo, bucket);
+            bucket->write_unlock();
+            return ret;
+        }
+
+        /*
+         * @brief
+         *  Get the value of key, or insert the key with value if it is absent.
+         *  It is atomic, see Bucket::find_or_put().
+         * */
+        bool find_or_insert(const key_type & key, const value_type & value, value_type * ret,
+                            victim_type * victim = NULL, bool * inserted = NULL) {
+            return find_or_insert(m_geo, key, value, ret, victim, inserted);
+        }
+
+        static bool find_or_insert(const geometry_type & geo, const key_type & key, const value_type & value,
+                                   value_type * ret, victim_type * victim, bool * inserted) {
+            sig_t sig = geo.signature(key);
+            bucket_type * bucket = lock_bucket(geo, sig);
+            node_type * node = bucket->find_or_put_nolock(sig, key, value, now(geo), geo.bucket_limit,
+                                                          victim, inserted);
+            if (node && ret)
+                *ret = node->value();
+
+            check_chain(geo, bucket);
+            bucket->write_unlock();
+            return node != NULL;
+        }
+
+        /*
+         * @brief
+         *  Multimap operations, value_type is a ValueBlock, see shm_hash_multimap.h.
+         *  A multimap is never reseeded, that would split the runs of values.
+         * */
+        template <typename _Item>
+        bool append(const key_type & key, const _Item & item) {
+            sig_t sig = m_geo.signature(key);
+            return get_bucket_by_sig(sig)->append(sig, key, item, now());
+        }
+
+        template <typename _Item>
+        uint32 find_all(const key_type & key, _Item * out, uint32 max) const {
+            sig_t sig = m_geo.signature(key);
+            return get_bucket_by_sig(sig)->lookup_all(sig, key, out, max);
+        }
+
+        template <typename _Item, typename _ItemEqual>
+        bool erase_value(const key_type & key, const _Item & item, _ItemEqual & equal) {
+            sig_t sig = m_geo.signature(key);
+            return get_bucket_by_sig(sig)->remove_value(sig, key, item, equal);
+        }
+
+        uint32 erase_all(const key_type & key) {
+            sig_t sig = m_geo.signature(key);
+            return get_bucket_by_sig(sig)->remove_all(sig, key);
+        }
+
+        /*
+         * @brief
+         *  Enable entry expiry. An entry which is not accessed for ttl ticks will
+         *  be removed by expire(). A zero ttl disables expiry.
+         *
+         *  Entries inserted before expiry is enabled are aged from time zero,
+         *  so they expire on the first sweep.
+         * */
+        void set_ttl(uint32 ttl) {
+            m_geo.ttl = ttl;
+            // Refresh the access time at most 16 times in a ttl period
+            m_geo.touch_gap = (ttl == 0) ? 0 : ((ttl >> 4) ? (ttl >> 4) : 1);
+            changed();
+        }
+
+        uint32 ttl(void) const {return m_geo.ttl;}
+
+        /*
+         * @brief
+         *  Turn this table into a cache which holds about entries entries. The
+         *  capacity is split evenly among buckets, an insert into a full bucket
+         *  evicts an entry of that bucket by CLOCK policy. Zero disables cache mode.
+         * */
+        void set_capacity(uint32 entries) {
+            m_geo.bucket_limit = (entries == 0) ? 0 : div_roundup(entries, m_geo.bucket_num);
+            changed();
+        }
+
+        bool cache_mode(void) const {return m_geo.bucket_limit != 0;}
+
+        /*
+         * @brief
+         *  Check the Bloom filter of a bucket before searching it. The filters are
+         *  always maintained by writers, this only decides whether lookups use them.
+         * */
+        void set_filter(bool enable) {
+            m_geo.use_filter = enable ? 1 : 0;
+            changed();
+        }
+
+        bool filter(void) const {return m_geo.use_filter != 0;}
+
+        /*
+         * @brief
+         *  Mark this table skewed when an insert finds its chain longer than limit,
+         *  see skewed(). A zero limit disables the check.
+         * */
+        void set_chain_limit(uint32 limit) {
+            m_geo.chain_limit = limit;
+            changed();
+        }
+
+        // If a chain has grown past the chain limit since the last reseed started
+        bool skewed(void) const {return m_skewed != 0;}
+
+        /*
+         * @brief
+         *  Reseed the bucket index, against keys chosen to fall into one bucket.
+         *  start_reseed() begins a new round of seed, then reseed() rehashes the
+         *  buckets in order, visiting at most budget buckets and nodes per call,
+         *  so a housekeeping lcore can call it in every loop. Lookups and changes
+         *  go on meanwhile: a key stays in its bucket of the old seed until that
+         *  bucket is rehashed, the epoch of the bucket tells where the key is.
+         *
+         *  Keys with the same signature share a bucket under any seed. Signatures
+         *  are hashed with the secret of the table, so they can not be chosen to
+         *  be equal either, unless the hasher ignores the seed, see seeded_hash().
+         * */
+        bool start_reseed(void) {
+            if (m_geo.buckets == NULL)
+                return false;
+
+            m_reseed_lock.lock();
+            bool start = !reseeding();
+            if (start) {
+                m_skewed = 0;
+                m_reseed_cursor = 0;
+                ++m_geo.epoch;
+                changed();
+            }
+            m_reseed_lock.unlock();
+
+            return start;
+        }
+
+        // Return the count of moved entries, see start_reseed()
+        uint32 reseed(uint32 budget) {
+            if (!reseeding())
+                return 0;
 
-            return bucket->update(sig, key, params, action);
+            m_reseed_lock.lock();
+            uint32 epoch = m_geo.epoch;
+            uint32 moved = 0;
+            uint32 work = 0;
+
+            if (epoch & 1) {
+                Rehash where(m_geo.buckets, m_geo.seed((epoch >> 1) + 1), m_geo.mask);
+                while (work < budget && m_reseed_cursor < m_geo.bucket_num) {
+                    bucket_type * bucket = &m_geo.buckets[m_reseed_cursor];
+                    bucket->write_lock();
+                    work += bucket->size() + 1;
+                    bool done = bucket->rehash_nolock(where, epoch + 1, &moved);
+                    bucket->write_unlock();
+
+                    // Out of node memory, try again in the next call
+                    if (!done)
+                        break;
+
+                    ++m_reseed_cursor;
+                }
+
+                if (m_reseed_cursor == m_geo.bucket_num) {
+                    ++m_geo.epoch;
+                    changed();
+                }
+            }
+            m_reseed_lock.unlock();
+
+            return moved;
+        }
+
+        bool reseeding(void) const {return (m_geo.epoch & 1) != 0;}
+
+        /*
+         * @brief
+         *  Move hot entries to the head of their chains, see Bucket::set_reorder().
+         *  It shortens lookups of skewed traffic at the cost of a few writes.
+         * */
+        void set_reorder(bool enable) {
+            if (m_geo.buckets == NULL)
+                return;
+
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i)
+                m_geo.buckets[i].set_reorder(enable);
+        }
+
+        /*
+         * @brief
+         *  Sweep buckets from where the last call stopped and remove expired
+         *  entries. budget bounds the number of buckets and nodes visited by
+         *  this call, so a housekeeping lcore can call it in every loop.
+         *
+         *  Only one lcore should sweep a table at a time.
+         *  Return the number of removed entries.
+         * */
+        uint32 expire(uint32 budget) {
+            if (m_geo.ttl == 0 || m_geo.buckets == NULL)
+                return 0;
+
+            uint32 now = coarse_ticks();
+            uint32 work = 0;
+            uint32 expired = 0;
+            uint32 visited = 0;
+
+            while (work < budget && visited < m_geo.bucket_num) {
+                bucket_type * bucket = &m_geo.buckets[m_expire_cursor];
+                m_expire_cursor = (m_expire_cursor + 1) & m_geo.mask;
+                ++visited;
+
+                expired += bucket->expire(now, m_geo.ttl, work);
+            }
+
+            return expired;
         }
 
-        // Clear this hash table
+        /*
+         * @brief
+         *  Apply a batch of AsyncCommand. Commands are grouped by bucket, and each
+         *  group is applied with one acquisition of the bucket write lock. The sort
+         *  is stable, so commands on the same key are applied in order.
+         *
+         *  cmds is reordered, result of each command is filled. If victims is not
+         *  NULL, victims[i] takes the entry evicted by cmds[i] in cache mode.
+         * */
+        template <typename _Command, typename _Modifier>
+        void apply_batch(_Command ** cmds, uint32 n, _Modifier &action, victim_type * victims = NULL) {
+            if (m_geo.buckets == NULL || n == 0)
+                return;
+
+            // Commands are grouped by their buckets of the round when the batch starts.
+            // A bucket still holds their keys if it is not rehashed since then.
+            const uint32 epoch = m_geo.epoch;
+            const uint32 seed = m_geo.seed(epoch >> 1);
+            const uint32 limit = epoch & ~1U;
+            std::stable_sort(cmds, cmds + n, BucketLess<_Command>(seed, m_geo.mask));
+
+            uint32 ts = now();
+            uint32 i = 0;
+            while (i < n) {
+                uint32 index = bucket_index(cmds[i]->sig, seed, m_geo.mask);
+                bucket_type * bucket = get_bucket_by_index(index);
+
+                bucket->write_lock();
+                if (settled(bucket, limit)) {
+                    for ( ; i < n && bucket_index(cmds[i]->sig, seed, m_geo.mask) == index; ++i)
+                        apply_nolock(bucket, cmds[i], action, ts, victims ? &victims[i] : NULL);
+
+                    check_chain(m_geo, bucket);
+                    bucket->write_unlock();
+                } else {
+                    // Rehashed by a reseed, locate the key of each command again
+                    bucket->write_unlock();
+                    for ( ; i < n && bucket_index(cmds[i]->sig, seed, m_geo.mask) == index; ++i) {
+                        bucket_type * dest = lock_bucket(m_geo, cmds[i]->sig);
+                        apply_nolock(dest, cmds[i], action, ts, victims ? &victims[i] : NULL);
+                        check_chain(m_geo, dest);
+                        dest->write_unlock();
+                    }
+                }
+            }
+        }
+
+        /*
+         * @brief
+         *  Clear this hash table. The cost does not depend on the count of entries,
+         *  each bucket resets its node pool instead of walking its chain.
+         *
+         *  All bucket locks are taken in index order before any bucket is reset,
+         *  so a lookup sees either the whole table or an empty table, and no
+         *  reader is left in a chain when its nodes are dropped. Other operations
+         *  except reseed() hold one bucket lock at a time, so this cannot deadlock,
+         *  except with an accessor held by the caller.
+         * */
         void clear(void) {
-            if (m_bucket_array == NULL)
+            if (m_geo.buckets == NULL)
                 return;
 
-            for (uint32 i = 0; i < m_bucket_num; ++i) {
-                m_bucket_array[i].clear();
+            // reseed() holds two bucket locks, keep it out
+            m_reseed_lock.lock();
+
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i)
+                m_geo.buckets[i].write_lock();
+
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i)
+                m_geo.buckets[i].clear_nolock();
+
+            unlock_all_buckets();
+
+            m_reseed_lock.unlock();
+        }
+
+        /*
+         * @brief
+         *  Insert n entries by the lcores of lcore_mask in parallel, and return the
+         *  count of inserted entries. A key which is in the table is skipped, the
+         *  first of duplicate keys wins. The current lcore does the work of an
+         *  lcore which can not be launched, all of it if lcore_mask is 0.
+         *
+         *  Each lcore owns a range of buckets. The keys are hashed in slices, and
+         *  the entries are sorted by owner, counting sort style, so each lcore
+         *  walks its own entries only. Then all buckets are locked, as clear()
+         *  does, and each lcore inserts its entries without locks, as no other
+         *  lcore touches its buckets. Lookups wait until all entries are in, so
+         *  they never see a part of them.
+         *
+         *  A reseed in progress is finished first. Return 0 if it can not go on,
+         *  as a bucket can not get node memory for the entries it moves.
+         * */
+        uint32 build(const key_type * keys, const value_type * values, uint32 n, u_int64_t lcore_mask) {
+            if (m_geo.buckets == NULL || n == 0)
+                return 0;
+
+            build_task tasks[MAX_BUILD_LCORES];
+            uint32 lcores[MAX_BUILD_LCORES];
+            uint32 workers = 0;
+            for (uint32 i = 0; i < MAX_BUILD_LCORES; ++i) {
+                if (lcore_mask & (1ULL << i))
+                    lcores[workers++] = i;
+            }
+
+            if (workers == 0)
+                lcores[workers++] = current_lcore();
+
+            // The signatures and the order of entries, then the counts of entries of
+            // each slice for each owner
+            size_t size = (size_t)n * (sizeof(sig_t) + sizeof(uint32)) + (size_t)workers * workers * sizeof(uint32);
+            sig_t * sigs = static_cast<sig_t *>(_Alloc::zmalloc_private("build_sigs", size, 0));
+            if (sigs == NULL)
+                return 0;
+
+            uint32 * order = reinterpret_cast<uint32 *>(sigs + n);
+            uint32 * counts = order + n;
+
+            // reseed() holds two bucket locks, keep it out and let it finish first.
+            // The seed does not change until m_reseed_lock is released.
+            if (!finish_reseed()) {
+                _Alloc::free_private(sigs);
+                return 0;
+            }
+
+            for (uint32 i = 0; i < workers; ++i) {
+                tasks[i].table = this;
+                tasks[i].keys = keys;
+                tasks[i].values = values;
+                tasks[i].sigs = sigs;
+                tasks[i].order = order;
+                tasks[i].counts = counts + i * workers;
+                tasks[i].n = n;
+                tasks[i].workers = workers;
+                tasks[i].id = i;
+                tasks[i].inserted = 0;
             }
+
+            run_build(hash_slice, tasks, lcores, workers);
+
+            // The entries of owner 0 from all slices come first, then those of owner 1,
+            // and so on. A slice keeps the input order, so the first duplicate wins.
+            // counts turns into the offset of each slice for each owner.
+            uint32 offset = 0;
+            for (uint32 owner = 0; owner < workers; ++owner) {
+                tasks[owner].begin = offset;
+                for (uint32 slice = 0; slice < workers; ++slice) {
+                    uint32 cnt = tasks[slice].counts[owner];
+                    tasks[slice].counts[owner] = offset;
+                    offset += cnt;
+                }
+                tasks[owner].end = offset;
+            }
+
+            run_build(scatter_slice, tasks, lcores, workers);
+
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i)
+                m_geo.buckets[i].write_lock();
+
+            run_build(insert_range, tasks, lcores, workers);
+
+            unlock_all_buckets();
+
+            m_reseed_lock.unlock();
+            _Alloc::free_private(sigs);
+
+            uint32 inserted = 0;
+            for (uint32 i = 0; i < workers; ++i)
+                inserted += tasks[i].inserted;
+
+            return inserted;
+        }
+
+        // Return memory of idle node lists after a traffic spike
+        uint32 shrink(void) {
+            if (m_geo.buckets == NULL)
+                return 0;
+
+            uint32 released = 0;
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i)
+                released += m_geo.buckets[i].shrink();
+
+            return released;
         }
 
         uint32 capacity(void) const {
-            if (m_bucket_array == NULL)
+            if (m_geo.buckets == NULL)
                 return 0;
 
             uint32 capacity = 0;
-            for (uint32 i = 0; i < m_bucket_num; ++i) {
-                capacity += m_bucket_array[i].capacity();
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i) {
+                capacity += m_geo.buckets[i].capacity();
             }
 
             return capacity;
         }
 
         uint32 free_entries(void) const {
-            if (m_bucket_array == NULL)
+            if (m_geo.buckets == NULL)
                 return 0;
 
             uint32 free_entries = 0;
-            for (uint32 i = 0; i < m_bucket_num; ++i) {
-                free_entries += m_bucket_array[i].free_entries();
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i) {
+                free_entries += m_geo.buckets[i].free_entries();
             }
 
             return free_entries;
         }
 
         uint32 used_entries(void) const {
-            if (m_bucket_array == NULL)
+            if (m_geo.buckets == NULL)
                 return 0;
 
             uint32 count = 0;
-            for (uint32 i = 0; i < m_bucket_num; ++i) {
-                count += m_bucket_array[i].size();
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i) {
+                count += m_geo.buckets[i].size();
             }
 
             return count;
@@ -151,64 +914,397 @@ class hash_table {
             os << "** Total Entries : " << capacity() << std::endl;
             os << "** Free  Entries : " << free_entries() << std::endl;
             os << "** Used  Entries : " << used_entries() << std::endl;
+
+            footprint_type fp;
+            footprint(&fp);
+            os << "** Memory        : " << fp.total_bytes << " bytes, buckets " << fp.bucket_bytes
+               << ", nodes up front " << fp.arena_bytes << ", nodes on demand " << fp.grown_bytes;
+            if (fp.budget)
+                os << ", budget " << fp.budget;
+            os << std::endl;
         }
 
     private:
+        static const uint32 MAX_BUILD_LCORES = 64;  // the bits of lcore mask of build()
+
+        // Release all bucket locks taken by clear() or build(), in reverse order as
+        // an elided lock may be nested in the transactions of the locks before it
+        void unlock_all_buckets(void) {
+            for (uint32 i = m_geo.bucket_num; i-- > 0; )
+                m_geo.buckets[i].write_unlock();
+        }
+
+        // The work of an lcore in build(), it hashes slice id and owns the buckets of id
+        struct build_task {
+            hash_table *       table;
+            const key_type *   keys;
+            const value_type * values;
+            sig_t *            sigs;
+            uint32 *           order;    // the entries sorted by owner
+            uint32 *           counts;   // the entries of this slice for each owner
+            uint32             n;
+            uint32             workers;
+            uint32             id;
+            uint32             begin;    // the entries of this owner in order
+            uint32             end;
+            uint32             inserted;
+        };
+
+        /*
+         * Take m_reseed_lock with no reseed in progress, finishing the reseed if
+         * there is one. Return false without the lock if the reseed stops, as a
+         * bucket can not get node memory.
+         * */
+        bool finish_reseed(void) {
+            for ( ; ; ) {
+                m_reseed_lock.lock();
+                if (!reseeding())
+                    return true;
+
+                uint32 epoch = m_geo.epoch;
+                uint32 cursor = m_reseed_cursor;
+                m_reseed_lock.unlock();
+
+                reseed(m_geo.bucket_num);
+                if (m_geo.epoch == epoch && m_reseed_cursor == cursor)
+                    return false;
+            }
+        }
+
+        // The lcore of build() which owns the bucket of sig
+        static uint32 build_owner(const geometry_type & geo, sig_t sig, uint32 workers) {
+            uint32 index = bucket_index(sig, geo.seed(geo.epoch >> 1), geo.mask);
+            return (u_int64_t)index * workers / geo.bucket_num;
+        }
+
+        // Run task on every lcore and wait for them, a task which can not be launched runs here
+        static void run_build(lcore_task_t task, build_task * tasks, const uint32 * lcores, uint32 workers) {
+            bool launched[MAX_BUILD_LCORES];
+            for (uint32 i = 0; i < workers; ++i)
+                launched[i] = launch_lcore(lcores[i], task, &tasks[i]);
+
+            for (uint32 i = 0; i < workers; ++i) {
+                if (!launched[i])
+                    task(&tasks[i]);
+            }
+
+            for (uint32 i = 0; i < workers; ++i) {
+                if (launched[i])
+                    wait_lcore(lcores[i]);
+            }
+        }
+
+        // Hash the keys of a slice of input, and count its entries of each owner
+        static int hash_slice(void * arg) {
+            build_task * task = static_cast<build_task *>(arg);
+            const geometry_type & geo = task->table->m_geo;
+            uint32 start = (u_int64_t)task->n * task->id / task->workers;
+            uint32 end = (u_int64_t)task->n * (task->id + 1) / task->workers;
+            for (uint32 i = start; i < end; ++i) {
+                task->sigs[i] = geo.signature(task->keys[i]);
+                ++task->counts[build_owner(geo, task->sigs[i], task->workers)];
+            }
+
+            return 0;
+        }
+
+        // Put the entries of a slice in order, at the offsets of the slice for each owner
+        static int scatter_slice(void * arg) {
+            build_task * task = static_cast<build_task *>(arg);
+            const geometry_type & geo = task->table->m_geo;
+            uint32 start = (u_int64_t)task->n * task->id / task->workers;
+            uint32 end = (u_int64_t)task->n * (task->id + 1) / task->workers;
+            for (uint32 i = start; i < end; ++i)
+                task->order[task->counts[build_owner(geo, task->sigs[i], task->workers)]++] = i;
+
+            return 0;
+        }
+
+        // Insert the entries of an owner, the locks of its buckets are held by build()
+        static int insert_range(void * arg) {
+            build_task * task = static_cast<build_task *>(arg);
+            const geometry_type & geo = task->table->m_geo;
+            uint32 seed = geo.seed(geo.epoch >> 1);
+            uint32 now_ticks = now(geo);
+            for (uint32 i = task->begin; i < task->end; ++i) {
+                uint32 entry = task->order[i];
+                bucket_type * bucket = &geo.buckets[bucket_index(task->sigs[entry], seed, geo.mask)];
+                if (bucket->put_nolock(task->sigs[entry], task->keys[entry], task->values[entry], now_ticks,
+                                       geo.bucket_limit))
+                    ++task->inserted;
+                check_chain(geo, bucket);
+            }
+
+            return 0;
+        }
+
         bool initialize(void) {
             // Adjust bucket number if necessary
-            if (!is_power_of_2(m_bucket_num))
-                m_bucket_num = convert_to_power_of_2(m_bucket_num);
+            if (!is_power_of_2(m_geo.bucket_num))
+                m_geo.bucket_num = convert_to_power_of_2(m_geo.bucket_num);
 
-            m_mask = m_bucket_num - 1;
+            m_geo.mask = m_geo.bucket_num - 1;
 
             // Allocate memory for bucket 
             char name[] = "bucket_array";
-            uint32 bucket_array_size_in_bytes = m_bucket_num * sizeof(bucket_type);
-            m_bucket_array = static_cast<bucket_type*>(rte_zmalloc(name, bucket_array_size_in_bytes, 0));
-            if (m_bucket_array == NULL) {
+            size_t bucket_array_size_in_bytes = (size_t)m_geo.bucket_num * sizeof(bucket_type);
+            m_geo.buckets = static_cast<bucket_type*>(_Alloc::zmalloc(name, bucket_array_size_in_bytes, 0));
+            if (m_geo.buckets == NULL)
                 return false;
-            } else {
-                // Initialize Buckets
-                for (uint32 i = 0; i < m_bucket_num; ++i)
-                    ::new (&m_bucket_array[i]) bucket_type;
-                return true;
+
+            // A table sized by plan() allocates the nodes of all buckets in one array
+            if (m_arena_nodes) {
+                size_t arena_size_in_bytes = (size_t)m_geo.bucket_num * m_arena_nodes * sizeof(node_type);
+                m_arena = static_cast<node_type*>(_Alloc::zmalloc("node_arena", arena_size_in_bytes, 0));
+                if (m_arena == NULL) {
+                    _Alloc::free(m_geo.buckets);
+                    m_geo.buckets = NULL;
+                    return false;
+                }
             }
+
+            // Initialize Buckets
+            for (uint32 i = 0; i < m_geo.bucket_num; ++i) {
+                if (m_arena)
+                    ::new (&m_geo.buckets[i]) bucket_type(&m_arena[(size_t)i * m_arena_nodes], m_arena_nodes,
+                                                          m_budget ? &m_allowance : NULL);
+                else
+                    ::new (&m_geo.buckets[i]) bucket_type;
+            }
+
+            return true;
         }
 
         void finalize(void) {
-            if (m_bucket_array) {
-                for (uint32 i = 0; i < m_bucket_num; ++i) {
-                    bucket_type * bucket = &(m_bucket_array[i]);
+            if (m_geo.buckets) {
+                for (uint32 i = 0; i < m_geo.bucket_num; ++i) {
+                    bucket_type * bucket = &(m_geo.buckets[i]);
                     // call the destructor of this bucket
                     if (bucket) {
                         bucket->~bucket_type();
                     }
                 }
-                rte_free(m_bucket_array);
-                m_bucket_array = NULL;
+                _Alloc::free(m_geo.buckets);
+                m_geo.buckets = NULL;
+            }
+
+            if (m_arena) {
+                _Alloc::free(m_arena);
+                m_arena = NULL;
             }
         }
 
         bucket_type * get_bucket_by_index(uint32 index) const {
-            if (m_bucket_array == NULL)
+            if (m_geo.buckets == NULL)
                 return NULL;
 
-            if (index < m_bucket_num)
-                return &m_bucket_array[index];
+            if (index < m_geo.bucket_num)
+                return &m_geo.buckets[index];
             else
                 return NULL;
         }
 
+        // The bucket of a signature in current round, it ignores a reseed in progress
         bucket_type * get_bucket_by_sig(sig_t sig) const {
-            return get_bucket_by_index(sig & m_mask);
+            return get_bucket_by_index(bucket_index(sig, m_geo.seed(m_geo.epoch >> 1), m_geo.mask));
         }
 
+        /*
+         * @brief
+         *  Find the bucket which holds the key of sig, or will hold it. While a
+         *  reseed is in progress, a key is in its bucket of the old seed until that
+         *  bucket is rehashed, and in its bucket of the new seed since then.
+         *
+         *  The bucket holds the key as long as its epoch is not above limit, see
+         *  settled(). geo is switched to the geometry of the table if it is older
+         *  than the bucket.
+         * */
+        static bucket_type * locate(const geometry_type * & geo, sig_t sig, uint32 * limit) {
+            for ( ; ; geo = &geo->table->m_geo) {
+                uint32 epoch = geo->epoch;
+                uint32 round = epoch >> 1;
+                bucket_type * bucket = &geo->buckets[bucket_index(sig, geo->seed(round), geo->mask)];
+                uint32 current = bucket->epoch();
+
+                if ((epoch & 1) && current == epoch + 1) {
+                    bucket = &geo->buckets[bucket_index(sig, geo->seed(round + 1), geo->mask)];
+                    current = epoch + 1;
+                    if (bucket->epoch() > current)
+                        continue;
+                } else if (current > epoch) {
+                    continue;
+                }
+
+                *limit = current;
+                return bucket;
+            }
+        }
+
+        // If a bucket found by locate() still holds the keys it held then
+        static bool settled(const bucket_type * bucket, uint32 limit) {
+            return bucket->epoch() <= limit;
+        }
+
+        // Write lock the bucket of sig, it is not rehashed until it is unlocked
+        static bucket_type * lock_bucket(const geometry_type & geo, sig_t sig) {
+            const geometry_type * g = &geo;
+            for ( ; ; ) {
+                uint32 limit;
+                bucket_type * bucket = locate(g, sig, &limit);
+                bucket->write_lock();
+                if (settled(bucket, limit))
+                    return bucket;
+
+                bucket->write_unlock();
+            }
+        }
+
+        // Mark the table skewed if the chain of bucket is too long, see set_chain_limit()
+        static void check_chain(const geometry_type & geo, const bucket_type * bucket) {
+            if (geo.chain_limit && bucket->size() > geo.chain_limit && !geo.table->m_skewed)
+                geo.table->m_skewed = 1;
+        }
+
+        static bool put(const geometry_type & geo, sig_t sig, const key_type & key, const value_type & value,
+                        victim_type * victim) {
+            if (geo.bucket_limit == 0)
+                return put_reserved(geo, sig, key, value);
+
+            bucket_type * bucket = lock_bucket(geo, sig);
+            bool ret = bucket->put_nolock(sig, key, value, now(geo), geo.bucket_limit, victim);
+            check_chain(geo, bucket);
+            bucket->write_unlock();
+            return ret;
+        }
+
+        // put() out of cache mode, the node is got before the bucket is locked. If the
+        // bucket is rehashed meanwhile, the node goes back to the pool it came from.
+        // A key which the bucket filter may hold is likely a duplicate, no node is got
+        // for it, so a duplicate insert does not take and return a node.
+        static bool put_reserved(const geometry_type & geo, sig_t sig, const key_type & key, const value_type & value) {
+            const geometry_type * g = &geo;
+            uint32 limit, stamp = 0;
+            bucket_type * home = locate(g, sig, &limit);
+            node_type * spare = home->may_contain(sig) ? NULL : home->reserve(&stamp);
+
+            bucket_type * bucket = lock_bucket(geo, sig);
+            bool ret;
+            if (bucket == home)
+                ret = bucket->put_reserved_nolock(sig, key, value, now(geo), &spare, stamp);
+            else
+                ret = bucket->put_nolock(sig, key, value, now(geo));
+            check_chain(geo, bucket);
+            bucket->write_unlock();
+
+            home->unreserve(spare, stamp);
+            return ret;
+        }
+
+        // remove() and modify() do not change the bucket if they fail, so they are
+        // simply retried if the bucket is rehashed meanwhile
+        static bool remove(const geometry_type & geo, sig_t sig, const key_type & key, value_type * ret) {
+            const geometry_type * g = &geo;
+            for ( ; ; ) {
+                uint32 limit;
+                bucket_type * bucket = locate(g, sig, &limit);
+                bool found = bucket->remove(sig, key, ret);
+                if (found || settled(bucket, limit))
+                    return found;
+            }
+        }
+
+        template <typename _Params, typename _Modifier>
+        static bool modify(const geometry_type & geo, sig_t sig, const key_type & key,
+                           _Params & params, _Modifier &action) {
+            const geometry_type * g = &geo;
+            for ( ; ; ) {
+                uint32 limit;
+                bucket_type * bucket = locate(g, sig, &limit);
+                bool found = bucket->update(sig, key, params, action, now(geo));
+                if (found || settled(bucket, limit))
+                    return found;
+            }
+        }
+
+        template <typename _Command, typename _Modifier>
+        void apply_nolock(bucket_type * bucket, _Command * cmd, _Modifier &action, uint32 ts, victim_type * victim) {
+            switch (cmd->op) {
+                case ASYNC_INSERT:
+                    cmd->result = bucket->put_nolock(cmd->sig, cmd->key, cmd->value, ts, m_geo.bucket_limit, victim);
+                    break;
+                case ASYNC_ERASE:
+                    cmd->result = bucket->remove_nolock(cmd->sig, cmd->key, &cmd->value);
+                    break;
+                case ASYNC_UPDATE:
+                    cmd->result = bucket->update_nolock(cmd->sig, cmd->key, cmd->value, action, ts);
+                    break;
+                default:
+                    cmd->result = false;
+                    break;
+            }
+        }
+
+        bool acquire(const_accessor & acc, const key_type & key, bool write) const {
+            acc.release();
+
+            sig_t sig = m_geo.signature(key);
+            const geometry_type * g = &m_geo;
+            for ( ; ; ) {
+                uint32 limit;
+                bucket_type * bucket = locate(g, sig, &limit);
+                if (!g->use_filter || bucket->may_contain(sig)) {
+                    acc.m_node = bucket->acquire(sig, key, write, g->touch_gap);
+                    if (acc.m_node) {
+                        acc.m_bucket = bucket;
+                        acc.m_write = write;
+                        return true;
+                    }
+                }
+
+                if (settled(bucket, limit))
+                    return false;
+            }
+        }
+
+        // The access time of a new or updated node, zero if expiry is disabled
+        uint32 now(void) const {return now(m_geo);}
+        static uint32 now(const geometry_type & geo) {return geo.ttl ? coarse_ticks() : 0;}
+
+        // Publish a change of settings to handles
+        void changed(void) {
+            compiler_barrier();
+            ++m_geo.version;
+        }
+
+
+        // The bucket of a signature under the seed of a reseed
+        class Rehash {
+            public:
+                Rehash(bucket_type * buckets, uint32 seed, uint32 mask)
+                    : m_buckets(buckets), m_seed(seed), m_mask(mask) {}
+
+                bucket_type * operator() (sig_t sig) const {
+                    return &m_buckets[bucket_index(sig, m_seed, m_mask)];
+                }
+
+            private:
+                bucket_type * m_buckets;
+                uint32        m_seed;
+                uint32        m_mask;
+        };
 
     private:
-        hasher       m_hash_func;
-        uint32       m_mask;
-        uint32       m_bucket_num;
-        bucket_type *m_bucket_array;
+        geometry_type m_geo;
+        // The cursor is written by every expire(), keep it off the cache line of m_geo
+        u_int8_t m_pad[SHM_CACHE_LINE_SIZE];
+        volatile uint32 m_expire_cursor; // the next bucket to sweep
+        volatile uint32 m_reseed_cursor; // the next bucket to rehash
+        volatile uint32 m_skewed;        // set by inserts, see set_chain_limit()
+        spinlock m_reseed_lock;          // held by reseed() and clear()
+        node_type * m_arena;             // the nodes allocated up front, NULL if not sized by plan()
+        uint32   m_arena_nodes;          // the nodes of each bucket in m_arena
+        volatile int64_t m_allowance;    // the bytes of budget left for node lists allocated on demand
+        u_int64_t m_budget;              // 0 means no limit
 };
 
 __SHM_STL_END
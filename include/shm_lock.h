@@ -0,0 +1,446 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_LOCK_H_
+#define __SHM_LOCK_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "shm_platform.h"
+
+__SHM_STL_BEGIN
+
+/*
+ * Statistics kept per lcore in process memory, _Stats is a POD. Non-EAL threads
+ * share the last slot. They are not static, so all translation units share them.
+ * Each slot is aligned to and padded to cache lines, so lcores which update
+ * their own statistics never write the same line.
+ */
+template <typename _Stats>
+struct lcore_stats_slot {
+    _Stats stats;
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+template <typename _Stats>
+inline lcore_stats_slot<_Stats> *
+lcore_stats_array(void) {
+    static lcore_stats_slot<_Stats> slots[SHM_MAX_LCORE + 1];
+    return slots;
+}
+
+// The statistics of lcore, SHM_MAX_LCORE is the slot of non-EAL threads
+template <typename _Stats>
+inline _Stats &
+lcore_stats_of(u_int32_t lcore) {
+    return lcore_stats_array<_Stats>()[lcore < SHM_MAX_LCORE ? lcore : SHM_MAX_LCORE].stats;
+}
+
+template <typename _Stats>
+inline _Stats &
+lcore_stats(void) {
+    return lcore_stats_of<_Stats>(current_lcore());
+}
+
+// Counters of lock waits, only contended acquisitions are measured
+struct lock_wait_stats {
+    u_int64_t waits;           // acquisitions which had to wait
+    u_int64_t wait_cycles;     // TSC cycles spent in waiting
+    u_int64_t max_wait_cycles; // the longest wait
+};
+
+inline void
+record_lock_wait(u_int64_t start) {
+    u_int64_t cycles = read_tsc() - start;
+    lock_wait_stats & stats = lcore_stats<lock_wait_stats>();
+    ++stats.waits;
+    stats.wait_cycles += cycles;
+    if (cycles > stats.max_wait_cycles)
+        stats.max_wait_cycles = cycles;
+}
+
+// The sum of lock wait counters of all lcores in this process
+inline lock_wait_stats
+lock_wait_total_stats(void) {
+    lock_wait_stats total = {0, 0, 0};
+    for (u_int32_t i = 0; i <= SHM_MAX_LCORE; ++i) {
+        const lock_wait_stats & stats = lcore_stats_of<lock_wait_stats>(i);
+        total.waits += stats.waits;
+        total.wait_cycles += stats.wait_cycles;
+        if (stats.max_wait_cycles > total.max_wait_cycles)
+            total.max_wait_cycles = stats.max_wait_cycles;
+    }
+
+    return total;
+}
+
+/*
+ * @brief : Exponential backoff for retries of a contended atomic operation, so
+ *          lcores which lose a race do not hammer the same cache line
+ * */
+class backoff {
+    public:
+        static const u_int32_t MAX_SPINS = 1024;
+
+        backoff() : m_spins(1) {}
+
+        void pause(void) {
+            for (u_int32_t i = 0; i < m_spins; ++i)
+                cpu_relax();
+
+            if (m_spins < MAX_SPINS)
+                m_spins <<= 1;
+        }
+
+    private:
+        u_int32_t m_spins;
+};
+
+/*
+ * @brief : A spin lock which lives in shared memory
+ * */
+class spinlock {
+    public:
+        spinlock() : m_locked(0) {}
+
+        void init(void) {m_locked = 0;}
+
+        void lock(void) {
+            while (__sync_lock_test_and_set(&m_locked, 1)) {
+                while (m_locked)
+                    cpu_relax();
+            }
+        }
+
+        bool trylock(void) {return __sync_lock_test_and_set(&m_locked, 1) == 0;}
+        void unlock(void) {__sync_lock_release(&m_locked);}
+
+    private:
+        volatile int32_t m_locked;
+};
+
+/*
+ * @brief : A reader-writer spin lock which lives in shared memory.
+ *
+ *          It has the same layout and algorithm as rte_rwlock_t: a counter which
+ *          is -1 when a writer holds the lock, or the count of readers. So DPDK
+ *          processes and plain Linux processes can share it.
+ * */
+class rwlock {
+    public:
+        rwlock() : m_cnt(0) {}
+
+        void init(void) {m_cnt = 0;}
+
+        void read_lock(void) {
+            int32_t x = m_cnt;
+            if (x >= 0 && __sync_bool_compare_and_swap(&m_cnt, x, x + 1))
+                return;
+
+            u_int64_t start = read_tsc();
+            backoff delay;
+            while (true) {
+                x = m_cnt;
+                // A writer holds the lock
+                if (x < 0) {
+                    cpu_relax();
+                    continue;
+                }
+
+                if (__sync_bool_compare_and_swap(&m_cnt, x, x + 1))
+                    break;
+
+                delay.pause();
+            }
+
+            record_lock_wait(start);
+        }
+
+        void read_unlock(void) {__sync_fetch_and_sub(&m_cnt, 1);}
+
+        void write_lock(void) {
+            if (__sync_bool_compare_and_swap(&m_cnt, 0, -1))
+                return;
+
+            u_int64_t start = read_tsc();
+            backoff delay;
+            while (true) {
+                // Readers or a writer hold the lock
+                if (m_cnt != 0) {
+                    cpu_relax();
+                    continue;
+                }
+
+                if (__sync_bool_compare_and_swap(&m_cnt, 0, -1))
+                    break;
+
+                delay.pause();
+            }
+
+            record_lock_wait(start);
+        }
+
+        void write_unlock(void) {__sync_fetch_and_add(&m_cnt, 1);}
+
+        // A writer holds the lock
+        bool write_locked(void) const {return m_cnt < 0;}
+        // Readers or a writer hold the lock
+        bool locked(void) const {return m_cnt != 0;}
+
+    private:
+        volatile int32_t m_cnt;
+};
+
+/*
+ * @brief : A phase-fair reader-writer lock (PF-T, Brandenburg and Anderson).
+ *
+ *          rwlock prefers readers, so a stream of readers can starve a writer.
+ *          Here writers take tickets and enter in FIFO order, and readers and
+ *          writers alternate: readers arriving while a writer waits enter after
+ *          that writer, and they enter together once it leaves. A writer waits
+ *          for at most one read phase and the writers before it.
+ *
+ *          rin and rout count arriving and leaving readers in units of READER,
+ *          the low bits of rin tell readers a writer is present and its phase.
+ * */
+class phase_fair_rwlock {
+    public:
+        static const u_int32_t READER = 0x100;
+        static const u_int32_t WRITER_BITS = 0x3;
+        static const u_int32_t WRITER_PRESENT = 0x2;
+        static const u_int32_t PHASE_ID = 0x1;
+
+        phase_fair_rwlock() : m_rin(0), m_rout(0), m_win(0), m_wout(0) {}
+
+        void init(void) {
+            m_rin = 0;
+            m_rout = 0;
+            m_win = 0;
+            m_wout = 0;
+        }
+
+        void read_lock(void) {
+            u_int32_t w = __sync_fetch_and_add(&m_rin, READER) & WRITER_BITS;
+            if (w == 0)
+                return;
+
+            // Wait until the writer of this phase leaves
+            u_int64_t start = read_tsc();
+            while (w == (m_rin & WRITER_BITS))
+                cpu_relax();
+            record_lock_wait(start);
+        }
+
+        void read_unlock(void) {__sync_fetch_and_add(&m_rout, READER);}
+
+        void write_lock(void) {
+            u_int32_t ticket = __sync_fetch_and_add(&m_win, 1);
+            u_int64_t start = 0;
+
+            // Wait for the writers before us
+            if (ticket != m_wout) {
+                start = read_tsc();
+                while (ticket != m_wout)
+                    cpu_relax();
+            }
+
+            // Block new readers, then wait for the readers already in
+            u_int32_t readers = __sync_fetch_and_add(&m_rin, WRITER_PRESENT | (ticket & PHASE_ID));
+            if (readers != m_rout) {
+                if (start == 0)
+                    start = read_tsc();
+                while (readers != m_rout)
+                    cpu_relax();
+            }
+
+            if (start)
+                record_lock_wait(start);
+        }
+
+        void write_unlock(void) {
+            __sync_fetch_and_and(&m_rin, ~WRITER_BITS);
+            ++m_wout;
+        }
+
+        bool write_locked(void) const {return (m_rin & WRITER_BITS) != 0;}
+        bool locked(void) const {return m_win != m_wout || m_rin != m_rout;}
+
+    private:
+        volatile u_int32_t m_rin;
+        volatile u_int32_t m_rout;
+        volatile u_int32_t m_win;
+        volatile u_int32_t m_wout;
+};
+
+// Counters of lock elision, kept per lcore in process memory
+struct elision_stats {
+    u_int64_t commits;   // critical sections run in a transaction
+    u_int64_t conflicts; // aborts caused by other cores touching the same data
+    u_int64_t capacity;  // aborts caused by a too large transaction
+    u_int64_t busy;      // aborts because the lock is held
+    u_int64_t others;    // other aborts, such as system calls or interrupts
+    u_int64_t fallbacks; // critical sections run with the lock
+};
+
+// The sum of counters of all lcores in this process
+inline elision_stats
+elision_total_stats(void) {
+    elision_stats total = {0, 0, 0, 0, 0, 0};
+    for (u_int32_t i = 0; i <= SHM_MAX_LCORE; ++i) {
+        const elision_stats & stats = lcore_stats_of<elision_stats>(i);
+        total.commits += stats.commits;
+        total.conflicts += stats.conflicts;
+        total.capacity += stats.capacity;
+        total.busy += stats.busy;
+        total.others += stats.others;
+        total.fallbacks += stats.fallbacks;
+    }
+
+    return total;
+}
+
+/*
+ * @brief : A reader-writer lock elided by RTM. A critical section runs in a
+ *          transaction which only reads the lock word, so readers do not write
+ *          the lock and do not bounce its cache line between cores. It does not
+ *          let writers of one bucket run together: every change writes the size,
+ *          the generation and the chain head of the bucket, and lookups write its
+ *          hint and access bits, so such sections conflict and abort each other.
+ *          The lock is taken after RETRIES aborts, or at once if the CPU has no
+ *          RTM, so it is a plain rwlock there.
+ *
+ *          Each thread records the locks it has elided, and only those are
+ *          released by ending a transaction. So elided and taken locks may be
+ *          held together and released in any order. At most MAX_ELIDED locks are
+ *          elided at once, as RTM can not nest deeper, further locks are taken.
+ *
+ *          It has the same layout as rwlock. Code in a critical section must not
+ *          depend on being elided: system calls, page faults and large writes
+ *          abort the transaction, and the section is run again with the lock.
+ * */
+class elided_rwlock {
+    public:
+        static const u_int32_t RETRIES = 3;
+        static const u_int32_t MAX_ELIDED = 7;
+
+        elided_rwlock() {}
+
+        void init(void) {m_lock.init();}
+
+        void read_lock(void) {
+            if (!elide(false))
+                m_lock.read_lock();
+        }
+
+        void read_unlock(void) {
+            if (!commit())
+                m_lock.read_unlock();
+        }
+
+        void write_lock(void) {
+            if (!elide(true))
+                m_lock.write_lock();
+        }
+
+        void write_unlock(void) {
+            if (!commit())
+                m_lock.write_unlock();
+        }
+
+    private:
+        // The locks elided by current thread. It is only changed in transactions,
+        // so an abort also rolls it back
+        struct elided_set {
+            const elided_rwlock * locks[MAX_ELIDED];
+            u_int32_t count;
+        };
+
+        static elided_set & elided(void) {
+            static __thread elided_set set = {{NULL}, 0};
+            return set;
+        }
+
+        // Start a transaction, return false if the lock should be taken
+        bool elide(bool write) {
+            if (!rtm_supported() || elided().count >= MAX_ELIDED)
+                return false;
+
+            elision_stats & stats = lcore_stats<elision_stats>();
+            for (u_int32_t i = 0; i < RETRIES; ++i) {
+                u_int32_t status = xbegin();
+                if (status == XBEGIN_STARTED) {
+                    // The lock word is in the read set, a thread taking the lock aborts us
+                    if (write ? m_lock.locked() : m_lock.write_locked())
+                        xabort_lock_busy();
+
+                    elided_set & set = elided();
+                    set.locks[set.count++] = this;
+                    return true;
+                }
+
+                if ((status & XABORT_EXPLICIT) && xabort_code(status) == XABORT_LOCK_BUSY) {
+                    ++stats.busy;
+                    // Wait for the holder instead of aborting again
+                    while (write ? m_lock.locked() : m_lock.write_locked())
+                        cpu_relax();
+                    continue;
+                }
+
+                if (status & XABORT_CONFLICT)
+                    ++stats.conflicts;
+                else if (status & XABORT_CAPACITY)
+                    ++stats.capacity;
+                else
+                    ++stats.others;
+
+                if (!(status & XABORT_RETRY))
+                    break;
+            }
+
+            ++stats.fallbacks;
+            return false;
+        }
+
+        // End a transaction if this lock is elided by current thread
+        bool commit(void) {
+            if (!rtm_supported())
+                return false;
+
+            elided_set & set = elided();
+            u_int32_t i = set.count;
+            while (i > 0 && set.locks[i - 1] != this)
+                --i;
+
+            if (i == 0)
+                return false;
+
+            for ( ; i < set.count; ++i)
+                set.locks[i - 1] = set.locks[i];
+            --set.count;
+
+            xend();
+            ++lcore_stats<elision_stats>().commits;
+            return true;
+        }
+
+    private:
+        rwlock m_lock;
+};
+
+__SHM_STL_END
+
+#endif
@@ -24,11 +24,10 @@
 #include <memory.h>
 #include <iostream>
 #include <sstream>
-#include <rte_malloc.h>
-#include <rte_eal.h>
-#include <rte_rwlock.h>
 #include "shm_hash_fun.h"
 #include "shm_common.h"
+#include "shm_allocator.h"
+#include "shm_profiler.h"
     
 __SHM_STL_BEGIN
 
@@ -39,49 +38,105 @@ typedef u_int32_t sig_t;
 typedef u_int32_t uint32;
 typedef int32_t   int32;
 
+// Print a free node by its index in the node pool
 template <typename _Node>
 struct PrintNode {
-    void operator() (const _Node & node, ostream & os) {
-        os << "[" << node.index() << "] --> ";
+    void operator() (const _Node &, uint32 index, ostream & os) {
+        os << "[" << index << "] --> ";
     }
 };
 
+/*
+ * NodeBody holds the key, the value and the one-byte fields of a node. Of the
+ * key and the value, the one with larger alignment is put first, then the other,
+ * then the small fields, so there is no padding between them and the small
+ * fields fill the tail padding. The choice is made at compile time by alignment.
+ * */
+template <typename _Key, typename _Value, bool _KeyFirst = (__alignof__(_Key) >= __alignof__(_Value))>
+struct NodeBody {
+    NodeBody() : m_ref(0) {}
+
+    _Key   m_key;
+    _Value m_value;
+    volatile u_int8_t m_ref; // the reference bit used by cache mode, set by lookup and cleared by eviction
+};
+
+template <typename _Key, typename _Value>
+struct NodeBody<_Key, _Value, false> {
+    NodeBody() : m_ref(0) {}
+
+    _Value m_value;
+    _Key   m_key;
+    volatile u_int8_t m_ref;
+};
+
+// The value type of key-only containers such as hash_set, it takes no space in node
+struct empty_value {};
+
+inline ostream & operator<< (ostream &os, const empty_value &) {return os << "-";}
+
+// Only the key and the reference bit are stored. The value is a shared static
+// object, so the code which reads or writes the value of a node still works
+template <typename _Key>
+struct NodeBody<_Key, empty_value, true> {
+    NodeBody() : m_ref(0) {}
+
+    _Key   m_key;
+    volatile u_int8_t m_ref;
+    static empty_value m_value;
+};
+
+template <typename _Key>
+empty_value NodeBody<_Key, empty_value, true>::m_value;
+
+/*
+ * @brief : A node of bucket chain. The link and the 4-byte fields come first, they
+ *          take 16 bytes on 64-bit system, then NodeBody, so every field is aligned
+ *          without padding. For example, Node<uint64_t, uint16_t> takes 32 bytes.
+ *
+ *          The layout does not depend on build flags, as processes built with
+ *          different flags share the nodes.
+ * */
 template <typename _Key, typename _Value>
 class Node {
     public:
-        Node () : m_sig(0), m_next(NULL) {}
+        Node () : m_next(NULL), m_sig(0), m_atime(0) {}
         ~Node () {}
         
-        void fill(_Key k, _Value v, sig_t s) {
-            m_key = k;
-            m_value = v;
+        void fill(const _Key &k, const _Value &v, sig_t s) {
+            m_body.m_key = k;
+            m_body.m_value = v;
             m_sig = s;
         }
 
         void set_next(Node * next) {m_next = next;}
-        void set_index(uint32 idx) {m_index = idx;}
+        void touch(uint32 now) {m_atime = now;}
+        void reference(void) {m_body.m_ref = 1;}
+        void clear_reference(void) {m_body.m_ref = 0;}
 
         template <typename _Params, typename _Modifier>
         void update(_Params& params, _Modifier &action) {
-            action(m_value, params);
+            action(m_body.m_value, params);
         }
 
-        _Key key(void) const {return m_key;}
-        _Value value(void) const {return m_value;}
+        // Keys and values are accessed by reference, so they are not copied on chain walk
+        const _Key & key(void) const {return m_body.m_key;}
+        const _Value & value(void) const {return m_body.m_value;}
+        _Value & value(void) {return m_body.m_value;}
         sig_t signature(void) const {return m_sig;}
+        uint32 atime(void) const {return m_atime;}
+        bool referenced(void) const {return m_body.m_ref != 0;}
         Node * next(void) const {return m_next;}
-        uint32 index(void) const {return m_index;}
 
         void str(std::ostream &os) {
-            os << "[ <" << m_key << ", " << m_value << ">, " << m_sig << " ] --> " << std::endl; 
+            os << "[ <" << m_body.m_key << ", " << m_body.m_value << ">, " << m_sig << " ] --> " << std::endl; 
         }
 
     private:
-        _Key   m_key;
-        _Value m_value; // The member of _Key and _Value should be volatile
-        sig_t  m_sig;   // the sinature - hash value
         Node * volatile m_next;  // the pointer of next node
-        uint32 m_index; // the index of this node in node list, it should never be changed after initialization
+        sig_t  m_sig;   // the sinature - hash value
+        volatile uint32 m_atime; // the last access time in coarse ticks, only maintained if expiry is enabled
+        NodeBody<_Key, _Value> m_body; // The member of _Key and _Value should be volatile
 };
 
 /*
@@ -95,12 +150,30 @@ class Node {
  *          lists including the first one at most.
  *
  *          All free nodes in free node lists are chained together and be accessed
- *          from m_nodepool_head.
+ *          from m_free_head.
+ *
+ *          The free node pool is a lock-free stack, so nodes can be got and put by
+ *          many threads without a lock. m_free_head packs the index of the first
+ *          free node and a counter which is increased by every change, the counter
+ *          makes a CAS fail if the head was popped and pushed back meanwhile (ABA).
+ *          A node index is the slot of its free list and its offset in the list.
+ *          Creating, releasing and resetting free lists take m_resize_lock.
+ *
+ *          A thread may read the link of a node which has just been popped by
+ *          another thread, or whose free list has just been released. It is safe
+ *          as shared memory is never unmapped, and then the CAS fails.
  *
  *          This class provides following methods to programmers:
  *          1. GetNode - Get a free node from FreeNodePool
  *          2. PutNode - Put a node to FreeNodePool
  *          3. PutNodeList - Put a list of nodes to FreeNodePool
+ *          4. GetNodes/PutNodes - Get or put an array of nodes in one CAS
+ *          5. Shrink - Release the free lists whose nodes are all free, except the first one
+ *
+ *          A pool may start with a list of nodes given by its owner, such as a part
+ *          of one array shared by all pools of a table. That list is never freed by
+ *          the pool. If an allowance is given, new lists are only created while it
+ *          covers their bytes, so the pools sharing it keep within a memory budget.
  *
  *          Important:
  *          1. Programmers should not free any node outside of FreeNodePool
@@ -112,24 +185,26 @@ class Node {
  *                                +-----------------------------------------------+
  *                 [the first list]  |     |   [create the second free list if the first is exhausted]
  *                                   V     +-----> +-------------------------------+
- *           m_nodepool_head -->  +-----+          |   |   |   |   |   |   |   |   |
+ *           m_free_head     -->  +-----+          |   |   |   |   |   |   |   |   |
  *                                |     |          +-------------------------------+
  *                                +-----+            ^
  *                                |     |            |
  *                                +-----+            |
  *                                |     |            |
  *                                +-----+            |
- *                                |     |            | [chain the new created free nodes to m_nodepool_head]
+ *                                |     |            | [chain the new created free nodes to m_free_head]
  *                                +-----+            |
  *                                   |_______________|
  *
  * */
-template <typename _Node>
+template <typename _Node, typename _Alloc = default_alloc>
 class NodePool {
     public:
         typedef _Node node_type;
         static const uint32 MAX_RESIZE_COUNT = 5;
         static const uint32 DEFAULT_LIST_SIZE = 16;  // The default size of the first free list
+        static const uint32 SLOT_SHIFT = 28;         // a node index is (slot << SLOT_SHIFT) | offset
+        static const uint32 NIL_INDEX = 0xFFFFFFFFU; // the index of no node
 
         NodePool(uint32 size = DEFAULT_LIST_SIZE)
             : m_init_size(size)
@@ -137,19 +212,58 @@ class NodePool {
             , m_free_entries(0)
             , m_freelist_num(0)
             , m_next_freelist_size(size)
-            , m_nodepool_head(NULL) {
-                for (uint32 i = 0; i < m_freelist_num; ++i)
+            , m_free_head(pack(NIL_INDEX, 0))
+            , m_shrink_mark(0)
+            , m_bump_slot(MAX_RESIZE_COUNT)
+            , m_bump_next(0)
+            , m_resets(0)
+            , m_reserving(0)
+            , m_borrowed(false)
+            , m_allowance(NULL) {
+                m_resize_lock.init();
+                for (uint32 i = 0; i < MAX_RESIZE_COUNT; ++i) {
                     m_freelist_array[i] = NULL;
+                    m_list_size[i] = 0;
+                }
 
+                m_resize_lock.lock();
                 resize();
+                m_resize_lock.unlock();
+            }
+
+        // Start with list of size nodes owned by the caller, see allowance above
+        NodePool(node_type * list, uint32 size, volatile int64_t * allowance)
+            : m_init_size(size)
+            , m_capacity(0)
+            , m_free_entries(0)
+            , m_freelist_num(0)
+            , m_next_freelist_size(size)
+            , m_free_head(pack(NIL_INDEX, 0))
+            , m_shrink_mark(0)
+            , m_bump_slot(MAX_RESIZE_COUNT)
+            , m_bump_next(0)
+            , m_resets(0)
+            , m_reserving(0)
+            , m_borrowed(true)
+            , m_allowance(allowance) {
+                m_resize_lock.init();
+                for (uint32 i = 0; i < MAX_RESIZE_COUNT; ++i) {
+                    m_freelist_array[i] = NULL;
+                    m_list_size[i] = 0;
+                }
+
+                add_list(0, list, size);
             }
 
         ~NodePool() {
-            for (uint32 i = 0; i < m_freelist_num; ++i) {
+            for (uint32 i = 0; i < MAX_RESIZE_COUNT; ++i) {
                 void * free_list = (void *)(m_freelist_array[i]);
                 if (free_list != NULL) {
-                    rte_free(free_list);
+                    // The first list is not ours if it is borrowed
+                    if (i != 0 || !m_borrowed)
+                        _Alloc::free(free_list);
                     m_freelist_array[i] = NULL;
+                    m_list_size[i] = 0;
                 }
             }
 
@@ -157,25 +271,100 @@ class NodePool {
             m_free_entries = 0;
             m_freelist_num = 0;
             m_next_freelist_size = m_init_size;
-            m_nodepool_head = NULL;
+            m_free_head = pack(NIL_INDEX, 0);
         }
 
         // Get a free node
         node_type * get_node(void) {
-            if (m_nodepool_head == NULL)
-                resize();
+            SHM_PROFILE_SCOPE("pool.get");
 
-            if (m_nodepool_head == NULL)
-                return NULL;
+            node_type * node = NULL;
+            if (pop(1, &node) == 0)
+                return get_unlinked_node();
+
+            __sync_fetch_and_sub(&m_free_entries, 1);
+            construct_node(node);
+
+            return node;
+        }
+
+        // Get at most n free nodes, return the count of nodes got
+        uint32 get_nodes(uint32 n, node_type ** out) {
+            uint32 cnt = n ? pop(n, out) : 0;
+            if (cnt) {
+                for (uint32 i = 0; i < cnt; ++i)
+                    construct_node(out[i]);
+
+                __sync_fetch_and_sub(&m_free_entries, cnt);
+            }
+
+            while (cnt < n) {
+                node_type * node = get_node();
+                if (node == NULL)
+                    break;
+
+                out[cnt++] = node;
+            }
+
+            return cnt;
+        }
+
+        /*
+         * @brief : Make all nodes free in O(1), the nodes in use are dropped. The free
+         *          lists are not relinked: the free node pool becomes empty, and a
+         *          cursor hands out the nodes of the free lists in order when the
+         *          pool is empty. Nodes returned later go to the pool as usual.
+         * */
+        void reset(void) {
+            // Make the count odd, then wait for reserve_node() and unreserve_node()
+            __sync_fetch_and_add(&m_resets, 1);
+            while (m_reserving)
+                cpu_relax();
+
+            m_resize_lock.lock();
+            take_all();
+            m_free_entries = m_capacity;
+            m_bump_slot = 0;
+            m_bump_next = 0;
+            m_shrink_mark = 0;
+            m_resize_lock.unlock();
+
+            __sync_fetch_and_add(&m_resets, 1);
+        }
 
-            // get the first free node
-            node_type * head = m_nodepool_head;
-            m_nodepool_head = head->next();
+        // Twice the count of reset() calls, odd during a reset(). A node got before
+        // a reset() is free after it
+        uint32 resets(void) const {return m_resets;}
+
+        /*
+         * @brief : Get a node without the lock of the owner, which reset() is called
+         *          with. A reset() does not overlap it, so stamp takes resets() of
+         *          the generation the node belongs to.
+         * */
+        node_type * reserve_node(uint32 * stamp) {
+            for ( ; ; ) {
+                __sync_fetch_and_add(&m_reserving, 1);
+                uint32 resets = m_resets;
+                if ((resets & 1) == 0) {
+                    node_type * node = get_node();
+                    __sync_fetch_and_sub(&m_reserving, 1);
+                    *stamp = resets;
+                    return node;
+                }
 
-            --m_free_entries;
-            construct_node(head);
+                // Wait for the reset
+                __sync_fetch_and_sub(&m_reserving, 1);
+                while (m_resets == resets)
+                    cpu_relax();
+            }
+        }
 
-            return head;
+        // Put back a node got by reserve_node(), unless a reset() has freed it since
+        void unreserve_node(node_type * node, uint32 stamp) {
+            __sync_fetch_and_add(&m_reserving, 1);
+            if (m_resets == stamp)
+                put_node(node);
+            __sync_fetch_and_sub(&m_reserving, 1);
         }
 
         // Return a node to free list
@@ -183,11 +372,21 @@ class NodePool {
             if (node == NULL)
                 return;
 
-            // Put this node at the front of m_free_node_list
-            node->set_next(m_nodepool_head); 
-            m_nodepool_head = node;
+            // Put this node at the front of free node pool
+            return_nodelist(node, node, 1);
+        }
+
+        // Return an array of nodes to free list in one operation
+        void put_nodes(uint32 n, node_type ** in) {
+            if (n == 0)
+                return;
+
+            // chain them together, the first node is the tail
+            in[0]->set_next(NULL);
+            for (uint32 i = 1; i < n; ++i)
+                in[i]->set_next(in[i - 1]);
 
-            ++m_free_entries;
+            return_nodelist(in[n - 1], in[0], n);
         }
 
         // Return nodes in a bucket to free list
@@ -199,6 +398,97 @@ class NodePool {
             return_nodelist(start, end, size);
         }
 
+        /*
+         * @brief : Release free lists after a traffic spike. A free list except the first
+         *          one is released if all of its nodes are free. The pool is only checked
+         *          when less than a quarter of the nodes are in use, and after a failed
+         *          check, only when 1/8 of capacity has been freed since. So the cost of
+         *          the check, which walks the free nodes, is paid rarely.
+         *
+         *          Return the count of released nodes
+         * */
+        uint32 shrink(void) {
+            if (m_freelist_num <= 1 || (m_capacity - m_free_entries) * 4 > m_capacity)
+                return 0;
+
+            if (m_free_entries <= m_shrink_mark + (m_capacity >> 3))
+                return 0;
+
+            // The free nodes are taken out, so the lists are checked without racing
+            // with get_node(), which waits for the lock when the pool looks empty
+            m_resize_lock.lock();
+            node_type * head = take_all();
+
+            // Count free nodes of each list, the nodes after the cursor are free
+            uint32 free_cnt[MAX_RESIZE_COUNT] = {0};
+            for (uint32 i = m_bump_slot; i < MAX_RESIZE_COUNT; ++i) {
+                if (m_freelist_array[i] != NULL)
+                    free_cnt[i] = m_list_size[i] - (i == m_bump_slot ? m_bump_next : 0);
+            }
+
+            for (node_type * node = head; node; node = node->next()) {
+                int32 list = list_of(node);
+                if (list >= 0)
+                    ++free_cnt[list];
+            }
+
+            bool idle[MAX_RESIZE_COUNT] = {false};
+            bool found = false;
+            for (uint32 i = 1; i < MAX_RESIZE_COUNT; ++i) {
+                idle[i] = (m_freelist_array[i] != NULL && free_cnt[i] == m_list_size[i]);
+                found = found || idle[i];
+            }
+
+            // Unlink the nodes of idle lists, and put the others back
+            node_type * prev = NULL;
+            node_type * node = head;
+            while (node) {
+                node_type * next = node->next();
+                int32 list = list_of(node);
+                if (list >= 0 && idle[list]) {
+                    if (prev)
+                        prev->set_next(next);
+                    else
+                        head = next;
+                } else {
+                    prev = node;
+                }
+                node = next;
+            }
+
+            if (head)
+                push(head, prev);
+
+            if (!found) {
+                m_shrink_mark = m_free_entries;
+                m_resize_lock.unlock();
+                return 0;
+            }
+
+            uint32 released = 0;
+            uint32 largest = 0;
+            for (uint32 i = 0; i < MAX_RESIZE_COUNT; ++i) {
+                if (idle[i]) {
+                    _Alloc::free((void *)m_freelist_array[i]);
+                    if (m_allowance)
+                        __sync_fetch_and_add(m_allowance, (int64_t)m_list_size[i] * sizeof(node_type));
+                    m_freelist_array[i] = NULL;
+                    released += m_list_size[i];
+                    m_list_size[i] = 0;
+                    --m_freelist_num;
+                } else if (m_list_size[i] > largest) {
+                    largest = m_list_size[i];
+                }
+            }
+
+            m_capacity -= released;
+            __sync_fetch_and_sub(&m_free_entries, released);
+            m_next_freelist_size = largest << 1;
+            m_shrink_mark = 0;
+            m_resize_lock.unlock();
+            return released;
+        }
+
         // Following three methods do not use lock
         uint32 capacity(void) const {return m_capacity;}
         uint32 free_entries(void) const {return m_free_entries;}
@@ -213,38 +503,164 @@ class NodePool {
             str(os);
 
             os << "\nFree Node Pool : " << std::endl;
-            node_type * start = m_nodepool_head;
+            node_type * start = node_at(index_of_head(m_free_head));
             PrintNode<node_type> action;
             uint32 cnt = 0;
             while (start && cnt < m_free_entries) {
-                action(*start, os);
+                action(*start, index_of(start), os);
                 start = start->next();
                 ++cnt;
             }
         }
 
     private:
-        // Create a new free node list and chain it to free node pool
+        static u_int64_t pack(uint32 index, uint32 tag) {return ((u_int64_t)tag << 32) | index;}
+        static uint32 index_of_head(u_int64_t head) {return (uint32)head;}
+        static uint32 tag_of_head(u_int64_t head) {return (uint32)(head >> 32);}
+
+        // The node of an index, NULL if its free list has been released
+        node_type * node_at(uint32 index) const {
+            if (index == NIL_INDEX)
+                return NULL;
+
+            node_type * list = m_freelist_array[index >> SLOT_SHIFT];
+            return list ? list + (index & ((1U << SLOT_SHIFT) - 1)) : NULL;
+        }
+
+        uint32 index_of(const node_type * node) const {
+            int32 list = node ? list_of(node) : -1;
+            if (list < 0)
+                return NIL_INDEX;
+
+            return ((uint32)list << SLOT_SHIFT) | (uint32)(node - m_freelist_array[list]);
+        }
+
+        /*
+         * Pop at most n nodes from free node pool by one CAS to out, return the count.
+         * The nodes are walked before the CAS, a link which is not in this pool can
+         * only be read from a node popped by another thread, so the CAS will fail.
+         * m_free_entries is not changed.
+         * */
+        uint32 pop(uint32 n, node_type ** out) {
+            for ( ; ; ) {
+                u_int64_t head = m_free_head;
+                node_type * first = node_at(index_of_head(head));
+                if (first == NULL) {
+                    if (head == m_free_head)
+                        return 0;
+                    continue;
+                }
+
+                node_type * next = first->next();
+                uint32 cnt = 1;
+                out[0] = first;
+                while (cnt < n && next && list_of(next) >= 0) {
+                    out[cnt++] = next;
+                    next = next->next();
+                }
+
+                if (__sync_bool_compare_and_swap(&m_free_head, head, pack(index_of(next), tag_of_head(head) + 1))) {
+                    // warm up the node which will be returned next time
+                    if (next)
+                        prefetch0(next);
+
+                    return cnt;
+                }
+            }
+        }
+
+        // Push the list from start to end, which are linked by next(), by one CAS.
+        // m_free_entries is not changed.
+        void push(node_type * start, node_type * end) {
+            uint32 index = index_of(start);
+            for ( ; ; ) {
+                u_int64_t head = m_free_head;
+                end->set_next(node_at(index_of_head(head)));
+                if (__sync_bool_compare_and_swap(&m_free_head, head, pack(index, tag_of_head(head) + 1)))
+                    break;
+            }
+        }
+
+        // Empty free node pool by one CAS, return its nodes
+        node_type * take_all(void) {
+            for ( ; ; ) {
+                u_int64_t head = m_free_head;
+                if (__sync_bool_compare_and_swap(&m_free_head, head, pack(NIL_INDEX, tag_of_head(head) + 1)))
+                    return node_at(index_of_head(head));
+            }
+        }
+
+        // Get a node from the cursor set by reset(), or from a new free list
+        node_type * get_unlinked_node(void) {
+            m_resize_lock.lock();
+
+            // Another thread may have refilled free node pool meanwhile
+            node_type * node = NULL;
+            if (pop(1, &node) == 0) {
+                // Skip the lists which are used up or released
+                while (m_bump_slot < MAX_RESIZE_COUNT && (m_freelist_array[m_bump_slot] == NULL
+                            || m_bump_next >= m_list_size[m_bump_slot])) {
+                    ++m_bump_slot;
+                    m_bump_next = 0;
+                }
+
+                if (m_bump_slot < MAX_RESIZE_COUNT) {
+                    node = &m_freelist_array[m_bump_slot][m_bump_next++];
+                } else {
+                    // A new list is only created after the cursor passes all lists, so
+                    // the cursor never hands out its nodes
+                    resize();
+                    pop(1, &node);
+                }
+            }
+            m_resize_lock.unlock();
+
+            if (node == NULL)
+                return NULL;
+
+            __sync_fetch_and_sub(&m_free_entries, 1);
+            construct_node(node);
+            return node;
+        }
+
+        // Create a new free node list and chain it to free node pool, with m_resize_lock
         void resize(void) {
             // Have reached the maxinum size
             if (m_freelist_num >= MAX_RESIZE_COUNT)
                 return;
 
-            // Create a new free list
+            // A released list leaves an empty slot
+            uint32 slot = 0;
+            while (m_freelist_array[slot] != NULL)
+                ++slot;
+
+            // Create a new free list, if the allowance covers it
             uint32 node_cnt = m_next_freelist_size;
             uint32 list_size_in_byte = node_cnt * sizeof(node_type);
+            if (m_allowance && __sync_sub_and_fetch(m_allowance, (int64_t)list_size_in_byte) < 0) {
+                __sync_fetch_and_add(m_allowance, (int64_t)list_size_in_byte);
+                return;
+            }
+
             std::ostringstream name;
-            name << "NodePool_FreeList_" << m_freelist_num;
-            node_type * new_list = static_cast<node_type *>(rte_zmalloc(name.str().c_str(), list_size_in_byte, 0));
-            if (new_list == NULL)
+            name << "NodePool_FreeList_" << slot;
+            node_type * new_list = static_cast<node_type *>(_Alloc::zmalloc(name.str().c_str(), list_size_in_byte, 0));
+            if (new_list == NULL) {
+                if (m_allowance)
+                    __sync_fetch_and_add(m_allowance, (int64_t)list_size_in_byte);
                 return;
+            }
 
-            // Now we have created the new free list successfully, add it to m_freelist_array
-            // and free node pool
-            initialize_freenode_list(new_list, node_cnt, m_capacity);
-            m_freelist_array[m_freelist_num] = new_list;
-            node_type * end_of_list = &new_list[node_cnt - 1];
-            return_nodelist(new_list, end_of_list, node_cnt); // PutNodeList will calculate m_free_entries
+            add_list(slot, new_list, node_cnt);
+        }
+
+        // Add a free list to m_freelist_array and free node pool
+        void add_list(uint32 slot, node_type * list, uint32 node_cnt) {
+            initialize_freenode_list(list, node_cnt);
+            m_freelist_array[slot] = list;
+            m_list_size[slot] = node_cnt;
+            node_type * end_of_list = &list[node_cnt - 1];
+            return_nodelist(list, end_of_list, node_cnt); // PutNodeList will calculate m_free_entries
 
             // Calculate new capacity, free_list_num and next_free_list_size 
             m_capacity += node_cnt;
@@ -252,34 +668,38 @@ class NodePool {
             m_next_freelist_size = node_cnt << 1;
         }
 
-        void initialize_freenode_list(node_type *list, uint32 size, uint32 index_start) {
-            uint32 i = 0;
-            for ( ; i < size - 1; ++i) {
+        void initialize_freenode_list(node_type *list, uint32 size) {
+            for (uint32 i = 0; i < size - 1; ++i) {
                 // call the constructor of node_type
                 node_type * node = &list[i];
                 construct_node(node);
                 node->set_next(&list[i + 1]);
-                node->set_index(index_start++);
             }
-
-            // Set the index of last node
-            list[i].set_index(index_start);
         }
 
-        // This private function does not use lock
         void return_nodelist(node_type *start, node_type *end, uint32 size) {
             // If start or end is NULL, do nothing
             if (!start || !end)
                 return;
 
-            // Put the node list decribed by start and end at the front of m_nodepool_head
-            end->set_next(m_nodepool_head);
-            m_nodepool_head = start;
-            m_free_entries += size;
+            // Put the node list decribed by start and end at the front of free node pool
+            push(start, end);
+            __sync_fetch_and_add(&m_free_entries, size);
         }
 
         void construct_node(node_type *node) {::new ((void *)node) node_type;}
 
+        // Find the free list a node belongs to, return -1 if it is not in this pool
+        int32 list_of(const node_type * node) const {
+            for (uint32 i = 0; i < MAX_RESIZE_COUNT; ++i) {
+                const node_type * list = m_freelist_array[i];
+                if (list && node >= list && node < list + m_list_size[i])
+                    return i;
+            }
+
+            return -1;
+        }
+
         void str(std::ostream &os) const {
             os << "Node Pool Status : " << std::endl;
             os << "Capacity      : " << m_capacity << std::endl;
@@ -293,8 +713,17 @@ class NodePool {
         volatile uint32     m_free_entries;       // the count of available free nodes in this pool
         volatile uint32     m_freelist_num;       // how many free lists we have now
         volatile uint32     m_next_freelist_size; // the size of next free list
-        node_type * volatile m_nodepool_head;      // the head of free node pool
-        node_type * volatile m_freelist_array[MAX_RESIZE_COUNT]; // free lists
+        volatile u_int64_t  m_free_head;          // the index of the first free node and a counter, see pack()
+        node_type * volatile m_freelist_array[MAX_RESIZE_COUNT]; // free lists, a released list leaves NULL
+        uint32              m_list_size[MAX_RESIZE_COUNT];      // the node count of each free list
+        uint32              m_shrink_mark;        // free entries at the last shrink check which found nothing
+        uint32              m_bump_slot;          // the free list of the cursor set by reset(), MAX_RESIZE_COUNT if unused
+        uint32              m_bump_next;          // the next node of the cursor in that free list
+        volatile uint32     m_resets;             // twice the count of reset() calls, odd during a reset()
+        volatile uint32     m_reserving;          // the threads in reserve_node() or unreserve_node()
+        spinlock            m_resize_lock;        // guards free lists and the cursor
+        bool                m_borrowed;           // the first free list is given by the owner
+        volatile int64_t *  m_allowance;          // the bytes which new lists may take, NULL if unlimited
 };
 
 __SHM_STL_END
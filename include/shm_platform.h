@@ -0,0 +1,267 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+/*
+ * CPU and thread primitives used by the containers. They are mapped to DPDK by
+ * default. Define SHM_STL_NO_DPDK to build without DPDK, for example in control
+ * plane daemons or unit tests which do not initialize EAL.
+ */
+
+#ifndef __SHM_PLATFORM_H_
+#define __SHM_PLATFORM_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef SHM_STL_NO_DPDK
+#include <rte_memory.h>
+#include <rte_cycles.h>
+#include <rte_prefetch.h>
+#include <rte_lcore.h>
+#include <rte_launch.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "shm_stl_config.h"
+
+__SHM_STL_BEGIN
+
+#ifndef SHM_STL_NO_DPDK
+const u_int32_t SHM_CACHE_LINE_SIZE = CACHE_LINE_SIZE;
+const u_int32_t SHM_MAX_LCORE = RTE_MAX_LCORE;
+#else
+const u_int32_t SHM_CACHE_LINE_SIZE = 64;
+const u_int32_t SHM_MAX_LCORE = 128;
+#endif
+
+// The role of a process which shares containers
+enum proc_type {
+    SHM_PROC_PRIMARY = 0,   // creates shared containers
+    SHM_PROC_SECONDARY,     // attaches to containers created by the primary
+    SHM_PROC_INVALID
+};
+
+static inline void
+cpu_relax(void) {
+    __asm__ __volatile__ ("pause" ::: "memory");
+}
+
+static inline void
+compiler_barrier(void) {
+    __asm__ __volatile__ ("" ::: "memory");
+}
+
+// A task run on another lcore by launch_lcore()
+typedef int (*lcore_task_t)(void * arg);
+
+/*
+ * Intel RTM (restricted transactional memory). The instructions are emitted as
+ * bytes, so no compiler flag is needed. rtm_supported() checks CPUID once, the
+ * other functions must only be called if it returns true.
+ */
+const u_int32_t XBEGIN_STARTED = ~0U;
+const u_int32_t XABORT_EXPLICIT = 1 << 0;
+const u_int32_t XABORT_RETRY = 1 << 1;
+const u_int32_t XABORT_CONFLICT = 1 << 2;
+const u_int32_t XABORT_CAPACITY = 1 << 3;
+const u_int32_t XABORT_LOCK_BUSY = 0xff; // the code of xabort_lock_busy()
+
+inline bool
+rtm_supported(void) {
+    static volatile int32_t supported = -1;
+    if (supported < 0) {
+        u_int32_t a, b, c, d;
+        __asm__ __volatile__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (0), "c" (0));
+        if (a >= 7) {
+            __asm__ __volatile__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (7), "c" (0));
+            supported = (b >> 11) & 1;
+        } else {
+            supported = 0;
+        }
+    }
+
+    return supported != 0;
+}
+
+// Return XBEGIN_STARTED in the transaction, or the abort status after an abort
+static inline u_int32_t
+xbegin(void) {
+    u_int32_t status = XBEGIN_STARTED;
+    __asm__ __volatile__ (".byte 0xc7, 0xf8; .long 0" : "+a" (status) :: "memory");
+    return status;
+}
+
+static inline void
+xend(void) {
+    __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd5" ::: "memory");
+}
+
+static inline void
+xabort_lock_busy(void) {
+    __asm__ __volatile__ (".byte 0xc6, 0xf8, 0xff" ::: "memory");
+}
+
+// If the caller runs in a transaction
+static inline bool
+xtest(void) {
+    u_int8_t in_tx;
+    __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd6; setnz %0" : "=r" (in_tx) :: "memory");
+    return in_tx != 0;
+}
+
+// The code passed to xabort, valid if XABORT_EXPLICIT is set in status
+static inline u_int32_t
+xabort_code(u_int32_t status) {
+    return (status >> 24) & 0xff;
+}
+
+#ifndef SHM_STL_NO_DPDK
+
+static inline u_int64_t read_tsc(void) {return rte_rdtsc();}
+static inline u_int64_t tsc_hz(void) {return rte_get_tsc_hz();}
+static inline void prefetch0(const volatile void * p) {rte_prefetch0(p);}
+
+// The id of current lcore, it is not less than SHM_MAX_LCORE for non-EAL threads
+static inline u_int32_t current_lcore(void) {return rte_lcore_id();}
+
+// Run task(arg) on lcore, which must be an idle slave lcore. Return false if it can not run there
+static inline bool
+launch_lcore(u_int32_t lcore, lcore_task_t task, void * arg) {
+    if (lcore >= SHM_MAX_LCORE || lcore == rte_lcore_id() || !rte_lcore_is_enabled(lcore))
+        return false;
+
+    return rte_eal_remote_launch(task, arg, lcore) == 0;
+}
+
+// Wait for the task launched on lcore, return its result
+static inline int wait_lcore(u_int32_t lcore) {return rte_eal_wait_lcore(lcore);}
+
+#else
+
+static inline u_int64_t
+read_tsc(void) {
+    u_int32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((u_int64_t)hi << 32) | lo;
+}
+
+// Measure the TSC frequency once, as EAL does. It is not static, so all
+// translation units share the result
+inline u_int64_t
+tsc_hz(void) {
+    static volatile u_int64_t hz = 0;
+    if (hz == 0) {
+        struct timespec sleep = {0, 10 * 1000 * 1000}; // 10ms
+        u_int64_t start = read_tsc();
+        nanosleep(&sleep, NULL);
+        hz = (read_tsc() - start) * 100;
+    }
+
+    return hz;
+}
+
+static inline void
+prefetch0(const volatile void * p) {
+    __builtin_prefetch((const void *)p, 0, 3);
+}
+
+// Threads get lcore ids in the order they call this function. It is not
+// static, so all translation units share the same counter
+inline u_int32_t
+current_lcore(void) {
+    static volatile u_int32_t next_id = 0;
+    static __thread u_int32_t id = (u_int32_t)-1;
+
+    if (id == (u_int32_t)-1)
+        id = __sync_fetch_and_add(&next_id, 1);
+
+    return id;
+}
+
+// Without EAL, a task launched on an lcore runs in a new thread
+struct lcore_thread {
+    pthread_t    thread;
+    lcore_task_t task;
+    void *       arg;
+    int          result;
+    bool         running;
+};
+
+inline lcore_thread *
+lcore_threads(void) {
+    static lcore_thread threads[SHM_MAX_LCORE];
+    return threads;
+}
+
+inline void *
+lcore_thread_main(void * arg) {
+    lcore_thread * t = static_cast<lcore_thread *>(arg);
+    t->result = t->task(t->arg);
+    return NULL;
+}
+
+inline bool
+launch_lcore(u_int32_t lcore, lcore_task_t task, void * arg) {
+    if (lcore >= SHM_MAX_LCORE || lcore_threads()[lcore].running)
+        return false;
+
+    lcore_thread * t = &lcore_threads()[lcore];
+    t->task = task;
+    t->arg = arg;
+    t->result = 0;
+    t->running = (pthread_create(&t->thread, NULL, lcore_thread_main, t) == 0);
+    return t->running;
+}
+
+inline int
+wait_lcore(u_int32_t lcore) {
+    if (lcore >= SHM_MAX_LCORE || !lcore_threads()[lcore].running)
+        return 0;
+
+    lcore_thread * t = &lcore_threads()[lcore];
+
+    pthread_join(t->thread, NULL);
+    t->running = false;
+    return t->result;
+}
+
+#endif
+
+// A random 32-bit value from the kernel, or from the TSC if it is not available
+inline u_int32_t
+random_seed(void) {
+    u_int32_t seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        ssize_t len = read(fd, &seed, sizeof(seed));
+        close(fd);
+        if (len == (ssize_t)sizeof(seed))
+            return seed;
+    }
+
+    u_int64_t tsc = read_tsc();
+    return (u_int32_t)(tsc ^ (tsc >> 32)) ^ ((u_int32_t)getpid() * 0x9E3779B1U);
+}
+
+__SHM_STL_END
+
+#endif
@@ -5,20 +5,81 @@
 #include <sstream>
 #include <fstream>
 #include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
 #include <unistd.h>
 
-#include <rte_cycles.h>
-
 #include "shm_common.h"
+#include "shm_allocator.h"
 
 __SHM_STL_BEGIN
 
+/*
+ * The profile board is an array of slots in shared memory, one slot per
+ * Profiler. A profiler publishes its statistics to its slot when a window is
+ * full, and a collector in any process reads the slots at its own pace, so the
+ * datapath never writes files. A slot is written under a sequence counter,
+ * a reader retries if the counter is odd or changes during its copy.
+ *
+ * Every record and the slot header take one cache line, so slots of profilers
+ * on different lcores never share a line.
+ */
+struct ProfileRecord {
+    static const uint32_t k_NameSize = 48;
+
+    uint64_t cycles;
+    uint32_t cnt;
+    uint32_t reserved;
+    char     name[k_NameSize];
+};
+
+struct ProfileSlot {
+    static const uint32_t k_NameSize = 48;
+    static const uint32_t k_StatsSize = 20;
+
+    volatile uint32_t owner;   // the pid of the owner, 0 if this slot is free
+    volatile uint32_t seq;     // odd while the owner writes this slot
+    uint32_t lcore;            // the lcore of the owner when it took this slot
+    uint32_t windows;          // the count of published windows
+    char     name[k_NameSize];
+    ProfileRecord stats[k_StatsSize];
+};
+
+struct ProfileBoard {
+    static const uint32_t k_Slots = 64;
+    static const uint64_t k_Magic = 0x73686d5f70726f66ULL; // "shm_prof"
+
+    volatile uint64_t magic;   // set after the board is cleared
+    uint8_t  reserved[56];
+    ProfileSlot slots[k_Slots];
+
+    // Get the board, the primary process creates it on first use. NULL if the
+    // allocator is not ready or the board is not created yet.
+    static ProfileBoard * get(void) {
+        const char * name = "shm_profile_board";
+        ProfileBoard * board = static_cast<ProfileBoard *>(default_alloc::lookup(name));
+        if (board == NULL && default_alloc::process_type() == SHM_PROC_PRIMARY) {
+            board = static_cast<ProfileBoard *>(default_alloc::reserve(name, sizeof(ProfileBoard)));
+            if (board) {
+                memset(board, 0, sizeof(ProfileBoard));
+                compiler_barrier();
+                board->magic = k_Magic;
+            } else {
+                // Another thread has created it
+                board = static_cast<ProfileBoard *>(default_alloc::lookup(name));
+            }
+        }
+
+        return (board && board->magic == k_Magic) ? board : NULL;
+    }
+};
+
 class Profiler {
     public:
-        static const uint32_t k_StatsSize = 20;
+        static const uint32_t k_StatsSize = ProfileSlot::k_StatsSize;
         static const uint32_t k_MaxCnt = 1 << 15;
         static const uint32_t k_MaxCycles = 1 << 30;
-        static const uint32_t k_MaxNameSize = 128; 
+        static const uint32_t k_MaxNameSize = 128;
 
         class Stats {
             public:
@@ -31,19 +92,28 @@ class Profiler {
             : m_enabled(true)
             , m_ready_to_log(false)
             , m_max_cnt(max_cnt)
-            , m_max_cycle(max_cycle) {
+            , m_max_cycle(max_cycle)
+            , m_slot(NULL)
+            , m_windows(0)
+            , m_dropped(0) {
             copy_name(&m_filename[0], name);
             memset(&m_stats_name[0][0], 0, k_StatsSize * k_MaxNameSize);
         }
-        ~Profiler() {}
+
+        ~Profiler() {
+            if (m_slot)
+                m_slot->owner = 0;
+        }
 
         void set_stats_name(const uint32_t index, const char * name) {copy_name(&m_stats_name[index][0], name);}
+        // The windows which are lost because the board has no free slot
+        uint32_t dropped_windows(void) const {return m_dropped;}
         void disable(void) {m_enabled = false;}
         void enable(void) {m_enabled = true;}
 
         uint64_t start(void) {
             if (m_enabled && m_ready_to_log) {
-                log_to_file();
+                publish();
                 clear();
             }
 
@@ -57,6 +127,17 @@ class Profiler {
             return read_tsc();
         }
 
+        // stop() for a probe, it names the statistic on its first use, see SHM_PROFILE_SCOPE
+        void probe(uint32_t index, const char * name, uint64_t start) {
+            if (index >= k_StatsSize)
+                return;
+
+            if (m_stats_name[index][0] == '\0')
+                set_stats_name(index, name);
+
+            stop(index, start);
+        }
+
         void log_to_file(std::ostringstream &log) {
             std::ostringstream filename;
             filename << "/tmp/shm_profiler_" << m_filename << getpid() << ".txt";
@@ -68,14 +149,14 @@ class Profiler {
         }
 
     private:
-        uint64_t read_tsc(void) {return rte_rdtsc();}
+        uint64_t read_tsc(void) {return ::shm_stl::read_tsc();}
 
-        void copy_name(char * dst, const char * src) {
+        void copy_name(char * dst, const char * src, uint32_t size = k_MaxNameSize) {
             if (src) {
-                strncpy(dst, src, k_MaxNameSize - 1);
-                dst[k_MaxNameSize - 1] = '\0';
+                strncpy(dst, src, size - 1);
+                dst[size - 1] = '\0';
             } else {
-                memset(dst, 0, k_MaxNameSize);
+                memset(dst, 0, size);
             }
         }
 
@@ -100,23 +181,46 @@ class Profiler {
             m_ready_to_log = false;
         }
 
-        void log_to_file(void) {
-            std::ostringstream filename;
-            filename << "/tmp/shm_profiler_" << m_filename << getpid() << ".txt";
-            //filename << "/tmp/shm_profiler_" << getpid() << ".txt";
+        // Take a free slot of the board, the window is dropped if there is none
+        bool claim(void) {
+            ProfileBoard * board = ProfileBoard::get();
+            if (board == NULL)
+                return false;
 
-            // Do not use std::ofstream::app here, it may cause a huge log file
-            std::ofstream ofs(filename.str().c_str());
-            if (ofs.is_open()) {
-                for (uint32_t i = 0; i < k_StatsSize; ++i) {
-                    if (m_stats[i].cnt > 0) {
-                        ofs << "Statistic " << i << " - " << &m_stats_name[i][0] 
-                            << " *** cycles :" << (m_stats[i].cycles / m_stats[i].cnt) 
-                            << ", cnt : " << m_stats[i].cnt << std::endl; 
-                    }
+            uint32_t pid = (uint32_t)getpid();
+            for (uint32_t i = 0; i < ProfileBoard::k_Slots; ++i) {
+                ProfileSlot * slot = &board->slots[i];
+                if (slot->owner == 0 && __sync_bool_compare_and_swap(&slot->owner, 0, pid)) {
+                    slot->lcore = current_lcore();
+                    copy_name(slot->name, m_filename, ProfileSlot::k_NameSize);
+                    m_slot = slot;
+                    return true;
                 }
-                ofs.close();
             }
+
+            return false;
+        }
+
+        // Copy the statistics of this window to the slot, it never blocks
+        void publish(void) {
+            if (m_slot == NULL && !claim()) {
+                ++m_dropped;
+                return;
+            }
+
+            ProfileSlot * slot = m_slot;
+            ++slot->seq;
+            compiler_barrier();
+
+            slot->windows = ++m_windows;
+            for (uint32_t i = 0; i < k_StatsSize; ++i) {
+                slot->stats[i].cycles = m_stats[i].cycles;
+                slot->stats[i].cnt = m_stats[i].cnt;
+                copy_name(slot->stats[i].name, &m_stats_name[i][0], ProfileRecord::k_NameSize);
+            }
+
+            compiler_barrier();
+            ++slot->seq;
         }
 
     private:
@@ -127,8 +231,222 @@ class Profiler {
         char m_stats_name[k_StatsSize][k_MaxNameSize];
         uint32_t m_max_cnt;
         uint32_t m_max_cycle;
+        ProfileSlot * m_slot;  // in the profile board, NULL before the first window is published
+        uint32_t m_windows;
+        uint32_t m_dropped;
+};
+
+/*
+ * ProfileCollector reads the profile board, in any process which shares it,
+ * and writes the last published window of each profiler as JSON or CSV.
+ */
+class ProfileCollector {
+    public:
+        ProfileCollector(void) : m_board(NULL) {}
+
+        bool attach(void) {
+            m_board = ProfileBoard::get();
+            return m_board != NULL;
+        }
+
+        // Copy the slots in use to out, return the count of copied slots
+        uint32_t snapshot(ProfileSlot * out, uint32_t max) const {
+            if (m_board == NULL)
+                return 0;
+
+            uint32_t cnt = 0;
+            for (uint32_t i = 0; i < ProfileBoard::k_Slots && cnt < max; ++i) {
+                const ProfileSlot * slot = &m_board->slots[i];
+                if (slot->owner == 0 || slot->windows == 0)
+                    continue;
+
+                if (read_slot(slot, &out[cnt]))
+                    ++cnt;
+            }
+
+            return cnt;
+        }
+
+        // Free the slots of processes which exited without releasing them
+        uint32_t reap(void) {
+            if (m_board == NULL)
+                return 0;
+
+            uint32_t freed = 0;
+            for (uint32_t i = 0; i < ProfileBoard::k_Slots; ++i) {
+                ProfileSlot * slot = &m_board->slots[i];
+                uint32_t owner = slot->owner;
+                if (owner && kill((pid_t)owner, 0) < 0 && errno == ESRCH) {
+                    if (__sync_bool_compare_and_swap(&slot->owner, owner, 0))
+                        ++freed;
+                }
+            }
+
+            return freed;
+        }
+
+        void dump_json(std::ostream &os) const {
+            ProfileSlot slots[ProfileBoard::k_Slots];
+            uint32_t cnt = snapshot(slots, ProfileBoard::k_Slots);
+
+            os << "[";
+            for (uint32_t i = 0; i < cnt; ++i) {
+                const ProfileSlot &slot = slots[i];
+                os << (i ? ",\n " : "") << "{\"profiler\": \"" << slot.name << "\", \"pid\": " << slot.owner
+                   << ", \"lcore\": " << slot.lcore << ", \"windows\": " << slot.windows << ", \"stats\": [";
+
+                bool first = true;
+                for (uint32_t j = 0; j < ProfileSlot::k_StatsSize; ++j) {
+                    const ProfileRecord &record = slot.stats[j];
+                    if (record.cnt == 0)
+                        continue;
+
+                    os << (first ? "" : ", ") << "{\"index\": " << j << ", \"name\": \"" << record.name
+                       << "\", \"cnt\": " << record.cnt << ", \"cycles\": " << (record.cycles / record.cnt) << "}";
+                    first = false;
+                }
+                os << "]}";
+            }
+            os << "]" << std::endl;
+        }
+
+        void dump_csv(std::ostream &os) const {
+            ProfileSlot slots[ProfileBoard::k_Slots];
+            uint32_t cnt = snapshot(slots, ProfileBoard::k_Slots);
+
+            os << "profiler,pid,lcore,windows,index,name,cnt,cycles" << std::endl;
+            for (uint32_t i = 0; i < cnt; ++i) {
+                const ProfileSlot &slot = slots[i];
+                for (uint32_t j = 0; j < ProfileSlot::k_StatsSize; ++j) {
+                    const ProfileRecord &record = slot.stats[j];
+                    if (record.cnt == 0)
+                        continue;
+
+                    os << slot.name << "," << slot.owner << "," << slot.lcore << "," << slot.windows << ","
+                       << j << "," << record.name << "," << record.cnt << "," << (record.cycles / record.cnt) << std::endl;
+                }
+            }
+        }
+
+    private:
+        // Copy a slot under its sequence counter, false if the owner keeps writing it
+        static bool read_slot(const ProfileSlot * slot, ProfileSlot * out) {
+            for (uint32_t retry = 0; retry < 16; ++retry) {
+                uint32_t seq = slot->seq;
+                if (seq & 1) {
+                    cpu_relax();
+                    continue;
+                }
+
+                compiler_barrier();
+                memcpy(out, (const void *)slot, sizeof(ProfileSlot));
+                compiler_barrier();
+
+                if (slot->seq == seq)
+                    return true;
+            }
+
+            return false;
+        }
+
+    private:
+        ProfileBoard * m_board;
 };
 
+#ifdef SHM_STL_PROFILE
+
+/*
+ * Probes time scopes of code into a Profiler per lcore, which publishes to the
+ * profile board like any other profiler. A probe is named by a string, each
+ * name gets a statistic index of the profilers on its first use, and all
+ * probes with the same name share it. Probes beyond k_StatsSize are ignored.
+ *
+ * The profiler of an lcore is created by the first probe on it, and only that
+ * lcore uses it. Threads without an lcore id below SHM_MAX_LCORE are not
+ * probed, they would share one profiler. Each profiler takes a slot of the
+ * board, when the board is full its windows are dropped, see dropped_windows().
+ *
+ * Probes are only built if SHM_STL_PROFILE is defined, otherwise
+ * SHM_PROFILE_SCOPE() expands to nothing.
+ */
+class ProbeSite {
+    public:
+        explicit ProbeSite(const char * name) : m_name(name), m_index(index_of(name)) {}
+
+        const char * name(void) const {return m_name;}
+        uint32_t index(void) const {return m_index;}
+
+    private:
+        // It runs once per site, so a linear search is fine
+        static uint32_t index_of(const char * name) {
+            static const char * names[Profiler::k_StatsSize];
+            static uint32_t count = 0;
+            static spinlock lock;
+
+            lock.lock();
+            uint32_t i = 0;
+            while (i < count && strcmp(names[i], name) != 0)
+                ++i;
+
+            if (i == count && count < Profiler::k_StatsSize)
+                names[count++] = name;
+            lock.unlock();
+
+            return i;
+        }
+
+        const char * m_name;
+        uint32_t     m_index;
+};
+
+// The profiler of probes on current lcore, NULL if the thread has no lcore id
+inline Profiler *
+probe_profiler(void) {
+    static Profiler * profilers[SHM_MAX_LCORE];
+
+    uint32_t lcore = current_lcore();
+    if (lcore >= SHM_MAX_LCORE)
+        return NULL;
+
+    if (profilers[lcore] == NULL) {
+        std::ostringstream name;
+        name << "probes_" << lcore;
+        profilers[lcore] = new Profiler(name.str().c_str());
+    }
+
+    return profilers[lcore];
+}
+
+// Times the scope it is declared in
+class ProfileScope {
+    public:
+        explicit ProfileScope(const ProbeSite &site)
+            : m_site(site), m_profiler(probe_profiler()), m_start(m_profiler ? m_profiler->start() : 0) {}
+
+        ~ProfileScope() {
+            if (m_profiler)
+                m_profiler->probe(m_site.index(), m_site.name(), m_start);
+        }
+
+    private:
+        const ProbeSite & m_site;
+        Profiler *        m_profiler;
+        uint64_t          m_start;
+};
+
+#define SHM_PROFILE_JOIN2(a, b) a##b
+#define SHM_PROFILE_JOIN(a, b) SHM_PROFILE_JOIN2(a, b)
+
+#define SHM_PROFILE_SCOPE(name) \
+    static const ::shm_stl::ProbeSite SHM_PROFILE_JOIN(shm_probe_site_, __LINE__)(name); \
+    ::shm_stl::ProfileScope SHM_PROFILE_JOIN(shm_probe_, __LINE__)(SHM_PROFILE_JOIN(shm_probe_site_, __LINE__))
+
+#else
+
+#define SHM_PROFILE_SCOPE(name) do {} while (0)
+
+#endif
+
 __SHM_STL_END
 
 #endif
@@ -0,0 +1,360 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_SHARDED_HASH_MAP_H_
+#define __SHM_SHARDED_HASH_MAP_H_
+
+#include "shm_hash_table.h"
+
+#include <iostream>
+#include <sstream>
+#include <sys/types.h>
+
+#define SHM_NAME_SIZE 32
+
+__SHM_STL_BEGIN
+
+/*
+ * @brief : sharded_hash_map splits the key space into shards by the high bits of
+ *          the hash value, mixed with a random seed of the map. Every shard is an independent hash table in its own
+ *          shared memory zone "SH_<name>_<i>", the states of shards are kept in
+ *          "SH_<name>".
+ *
+ *          A shard is shared by default, all lcores change it under the bucket
+ *          locks as in hash_map. Or it is owned by an lcore: the owner changes it
+ *          without any lock, and changes by other lcores are rejected. Other lcores
+ *          and processes still read an owned shard, by a lookup without lock which
+ *          is retried if the owner changed the shard meanwhile. So an lcore which
+ *          owns the shards of its flows runs to completion without synchronization.
+ *
+ *          The owner of a shard is set before the shard is used, or while no other
+ *          lcore changes it. An owned shard is only cleared by its owner, and it is
+ *          never shrunk.
+ * */
+template <typename _Key, typename _Value, typename _HashFunc = hash<_Key>, typename _EqualKey = std::equal_to<_Key>,
+          typename _Alloc = default_alloc, typename _Lock = rwlock>
+class sharded_hash_map {
+    public:
+        typedef _Key key_type;
+        typedef _Value value_type;
+        typedef _HashFunc hasher;
+        typedef _EqualKey key_equal;
+        typedef _Alloc allocator_type;
+        typedef _Lock lock_type;
+        typedef hash_table<key_type, value_type, hasher, key_equal, allocator_type, lock_type> _Ht;
+
+        static const uint32 MAX_SHARDS = 64;
+        static const uint32 DEFAULT_SHARDS = 16;
+        static const uint32 SHARED = 0xFFFFFFFFU;  // the owner of a shared shard
+
+        // The state of a shard, each takes a cache line as the owner writes it on every change
+        struct shard_state {
+            volatile uint32 owner;  // the lcore which owns the shard, SHARED if it is shared
+            volatile uint32 seq;    // odd while the owner changes the shard
+            u_int8_t pad[SHM_CACHE_LINE_SIZE - 2 * sizeof(uint32)];
+        };
+
+        struct shard_header {
+            uint32 shards;
+            uint32 seed;    // mixed into the hash value to choose the shard
+            uint32 secret;  // the signature secret of all shards, a key has one signature
+            u_int8_t pad[SHM_CACHE_LINE_SIZE - 3 * sizeof(uint32)];
+            shard_state states[MAX_SHARDS];
+        };
+
+    public:
+        // shards is rounded up to a power of 2, buckets is the bucket count of each shard
+        sharded_hash_map(const char * name, uint32 shards = DEFAULT_SHARDS, uint32 buckets = DEFAULT_BUCKET_NUM)
+            : m_shard_num(shards), m_buckets(buckets), m_shift(32), m_header(NULL) {
+                snprintf(m_name, sizeof(m_name), "SH_%s", name);
+                memset(m_shards, 0, sizeof(m_shards));
+            }
+
+        ~sharded_hash_map() {
+            if (m_header && _Alloc::process_type() == SHM_PROC_PRIMARY) {
+                for (uint32 i = 0; i < m_shard_num; ++i) {
+                    if (m_shards[i])
+                        m_shards[i]->~_Ht();
+                }
+            }
+
+            memset(m_shards, 0, sizeof(m_shards));
+            m_header = NULL;
+        }
+
+        bool create_or_attach(void) {
+            const proc_type type = _Alloc::process_type();
+
+            if (type == SHM_PROC_PRIMARY) {
+                if (m_shard_num == 0 || m_shard_num > MAX_SHARDS)
+                    return false;
+                if (!is_power_of_2(m_shard_num))
+                    m_shard_num = convert_to_power_of_2(m_shard_num);
+                if (m_shard_num > MAX_SHARDS)
+                    return false;
+
+                m_header = static_cast<shard_header *>(_Alloc::reserve(&m_name[0], sizeof(shard_header)));
+                if (m_header == NULL)
+                    return false;
+
+                m_header->shards = m_shard_num;
+                m_header->seed = random_seed();
+                do {
+                    m_header->secret = random_seed();
+                } while (m_header->secret == 0);
+                for (uint32 i = 0; i < MAX_SHARDS; ++i) {
+                    m_header->states[i].owner = SHARED;
+                    m_header->states[i].seq = 0;
+                }
+            } else if (type == SHM_PROC_SECONDARY) {
+                m_header = static_cast<shard_header *>(_Alloc::lookup(&m_name[0]));
+                if (m_header == NULL)
+                    return false;
+
+                m_shard_num = m_header->shards;
+            } else {
+                return false;
+            }
+
+            m_shift = 32;
+            for (uint32 n = m_shard_num; n > 1; n >>= 1)
+                --m_shift;
+
+            for (uint32 i = 0; i < m_shard_num; ++i) {
+                char name[SHM_NAME_SIZE + 12];
+                snprintf(name, sizeof(name), "%s_%u", m_name, i);
+                if (type == SHM_PROC_PRIMARY) {
+                    void * addr = _Alloc::reserve(name, sizeof(_Ht));
+                    m_shards[i] = addr ? ::new (addr) _Ht(m_buckets, m_header->secret) : NULL;
+                } else {
+                    m_shards[i] = static_cast<_Ht *>(_Alloc::lookup(name));
+                }
+
+                if (m_shards[i] == NULL)
+                    return false;
+            }
+
+            return true;
+        }
+
+        uint32 shards(void) const {return m_header ? m_shard_num : 0;}
+
+        // The shard of a key, it is decided by the high bits of the hash value
+        uint32 shard_of(const key_type & key) const {
+            return m_header ? shard_by_sig(m_shards[0]->signature(key)) : 0;
+        }
+
+        /*
+         * @brief : Let lcore own a shard, or share it if lcore is SHARED. See above
+         *          for when it may be called.
+         * */
+        void set_owner(uint32 shard, uint32 lcore) {
+            if (m_header && shard < m_shard_num)
+                m_header->states[shard].owner = lcore;
+        }
+
+        uint32 owner(uint32 shard) const {
+            return (m_header && shard < m_shard_num) ? m_header->states[shard].owner : SHARED;
+        }
+
+        // Return false if the key exists, there is no free node, or the shard is owned by another lcore
+        bool insert(const key_type & key, const value_type & value) {
+            if (m_header == NULL)
+                return false;
+
+            sig_t sig = m_shards[0]->signature(key);
+            uint32 shard = shard_by_sig(sig);
+            shard_state & state = m_header->states[shard];
+            uint32 owner = state.owner;
+            if (owner == SHARED)
+                return m_shards[shard]->insert_hashed(sig, key, value);
+            if (owner != current_lcore())
+                return false;
+
+            begin_change(state);
+            bool ret = m_shards[shard]->owner_insert(sig, key, value);
+            end_change(state);
+            return ret;
+        }
+
+        bool find(const key_type & key, value_type * ret = NULL) const {
+            if (m_header == NULL)
+                return false;
+
+            sig_t sig = m_shards[0]->signature(key);
+            uint32 shard = shard_by_sig(sig);
+            const shard_state & state = m_header->states[shard];
+            uint32 owner = state.owner;
+            if (owner == SHARED)
+                return m_shards[shard]->lookup(sig, key, ret, NULL);
+            if (owner == current_lcore())
+                return m_shards[shard]->peek(sig, key, ret);
+
+            // Read the shard of another lcore, retry if the owner changed it meanwhile
+            value_type value = value_type();
+            for ( ; ; ) {
+                uint32 seq = state.seq;
+                if (seq & 1) {
+                    cpu_relax();
+                    continue;
+                }
+
+                compiler_barrier();
+                bool found = m_shards[shard]->peek(sig, key, &value);
+                compiler_barrier();
+                if (state.seq == seq) {
+                    if (found && ret)
+                        *ret = value;
+                    return found;
+                }
+            }
+        }
+
+        bool erase(const key_type & key, value_type * ret = NULL) {
+            if (m_header == NULL)
+                return false;
+
+            sig_t sig = m_shards[0]->signature(key);
+            uint32 shard = shard_by_sig(sig);
+            shard_state & state = m_header->states[shard];
+            uint32 owner = state.owner;
+            if (owner == SHARED)
+                return m_shards[shard]->erase_hashed(sig, key, ret);
+            if (owner != current_lcore())
+                return false;
+
+            begin_change(state);
+            bool found = m_shards[shard]->owner_erase(sig, key, ret);
+            end_change(state);
+            return found;
+        }
+
+        template <typename _Params, typename _Modifier>
+        bool update(const key_type & key, _Params & params, _Modifier & action) {
+            if (m_header == NULL)
+                return false;
+
+            sig_t sig = m_shards[0]->signature(key);
+            uint32 shard = shard_by_sig(sig);
+            shard_state & state = m_header->states[shard];
+            uint32 owner = state.owner;
+            if (owner == SHARED)
+                return m_shards[shard]->update(key, params, action);
+            if (owner != current_lcore())
+                return false;
+
+            begin_change(state);
+            bool found = m_shards[shard]->owner_update(sig, key, params, action);
+            end_change(state);
+            return found;
+        }
+
+        // Clear the shared shards and the shards owned by current lcore
+        void clear(void) {
+            for (uint32 i = 0; i < shards(); ++i) {
+                shard_state & state = m_header->states[i];
+                if (state.owner == SHARED) {
+                    m_shards[i]->clear();
+                } else if (state.owner == current_lcore()) {
+                    begin_change(state);
+                    m_shards[i]->clear();
+                    end_change(state);
+                }
+            }
+        }
+
+        // Release node memory of the shared shards, return the count of released nodes
+        uint32 shrink(void) {
+            uint32 released = 0;
+            for (uint32 i = 0; i < shards(); ++i) {
+                if (m_header->states[i].owner == SHARED)
+                    released += m_shards[i]->shrink();
+            }
+
+            return released;
+        }
+
+        void print(void) {
+            std::ostringstream os;
+            if (m_header) {
+                for (uint32 i = 0; i < m_shard_num; ++i) {
+                    os << "\nShard " << i << " : ";
+                    if (m_header->states[i].owner == SHARED)
+                        os << "shared";
+                    else
+                        os << "owned by lcore " << m_header->states[i].owner;
+                    m_shards[i]->str(os);
+                }
+            } else {
+                os << "Sharded hash map is not created!" << std::endl;
+            }
+
+            std::cout << os.str().c_str() << std::endl;
+        }
+
+        uint32 capacity(void) const {
+            uint32 count = 0;
+            for (uint32 i = 0; i < shards(); ++i)
+                count += m_shards[i]->capacity();
+            return count;
+        }
+
+        uint32 free_entries(void) const {
+            uint32 count = 0;
+            for (uint32 i = 0; i < shards(); ++i)
+                count += m_shards[i]->free_entries();
+            return count;
+        }
+
+        uint32 used_entries(void) const {
+            uint32 count = 0;
+            for (uint32 i = 0; i < shards(); ++i)
+                count += m_shards[i]->used_entries();
+            return count;
+        }
+
+    private:
+        uint32 shard_by_sig(sig_t sig) const {
+            return (uint32)((u_int64_t)bucket_index(sig, m_header->seed, 0xFFFFFFFFU) >> m_shift);
+        }
+
+        // The owner makes the sequence odd during a change, readers retry on any change
+        static void begin_change(shard_state & state) {
+            state.seq = state.seq + 1;
+            compiler_barrier();
+        }
+
+        static void end_change(shard_state & state) {
+            compiler_barrier();
+            state.seq = state.seq + 1;
+        }
+
+    private:
+        uint32 m_shard_num;
+        uint32 m_buckets;
+        uint32 m_shift;        // the hash value is shifted right by it to get the shard
+        char   m_name[SHM_NAME_SIZE + 1];  // a longer name is kept long enough to be rejected by _Alloc
+        shard_header * m_header;
+        _Ht *  m_shards[MAX_SHARDS];
+};
+
+#undef SHM_NAME_SIZE
+
+__SHM_STL_END
+
+#endif
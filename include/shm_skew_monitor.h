@@ -0,0 +1,287 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Bruce.Li <jiangwlee@163.com>, 2014
+ */
+
+
+#ifndef __SHM_SKEW_MONITOR_H_
+#define __SHM_SKEW_MONITOR_H_
+
+#include <sys/types.h>
+#include <memory.h>
+#include <iostream>
+#include "shm_common.h"
+#include "shm_lock.h"
+#include "shm_node_pool.h"
+
+using std::ostream;
+
+__SHM_STL_BEGIN
+
+/*
+ * @brief : SkewMonitor watches the balance of a hash table. It lives in shared
+ *          memory, so any process can update or read it.
+ *
+ *          scan() walks the bucket sizes and keeps the histogram of chain lengths
+ *          and the longest buckets. sample() is called on lookups, one of 2^shift
+ *          lookups of each lcore is counted in a count-min sketch by signature,
+ *          and the keys with the largest estimates are kept as heavy hitters.
+ *          age() halves all counts, so old traffic fades out.
+ * */
+template <typename _Key>
+class SkewMonitor {
+    public:
+        static const uint32 HISTOGRAM_SIZE = 8;  // chain length 0, 1, 2-3, 4-7, ..., 64+
+        static const uint32 TOP_BUCKETS = 8;
+        static const uint32 HEAVY_HITTERS = 8;
+        static const uint32 SKETCH_DEPTH = 4;
+        static const uint32 SKETCH_SHIFT = 10;
+        static const uint32 SKETCH_WIDTH = 1 << SKETCH_SHIFT;
+
+        struct bucket_info {
+            uint32 index;
+            uint32 length;
+        };
+
+        struct hitter_info {
+            sig_t  sig;
+            uint32 count;  // the estimated count of sampled lookups
+            _Key   key;
+        };
+
+        SkewMonitor(uint32 sample_shift = 10)
+            : m_sample_mask((1U << sample_shift) - 1), m_hitter_floor(0)
+            , m_scans(0), m_entries(0), m_max_length(0), m_samples(0) {
+                m_lock.init();
+                memset(m_histogram, 0, sizeof(m_histogram));
+                memset(m_top, 0, sizeof(m_top));
+                memset(m_sketch, 0, sizeof(m_sketch));
+                for (uint32 i = 0; i < HEAVY_HITTERS; ++i) {
+                    m_hitters[i].sig = 0;
+                    m_hitters[i].count = 0;
+                }
+            }
+
+        /*
+         * If this lookup should be sampled. The count of lookups is per thread,
+         * so the check on every find() writes no line shared with other threads.
+         */
+        bool sampling(void) const {
+            static __thread u_int32_t lookups = 0;
+            return (++lookups & m_sample_mask) == 0;
+        }
+
+        // Count a sampled lookup
+        void sample(sig_t sig, const _Key & key) {
+            __sync_fetch_and_add(&m_samples, 1);
+
+            uint32 estimate = (uint32)-1;
+            for (uint32 i = 0; i < SKETCH_DEPTH; ++i) {
+                uint32 count = __sync_add_and_fetch(&m_sketch[i][slot(i, sig)], 1);
+                if (count < estimate)
+                    estimate = count;
+            }
+
+            // Most samples stop here without taking the lock
+            if (estimate <= m_hitter_floor)
+                return;
+
+            m_lock.lock();
+            uint32 min = 0;
+            for (uint32 i = 0; i < HEAVY_HITTERS; ++i) {
+                if (m_hitters[i].count && m_hitters[i].sig == sig) {
+                    min = i;
+                    break;
+                }
+
+                if (m_hitters[i].count < m_hitters[min].count)
+                    min = i;
+            }
+
+            if (estimate > m_hitters[min].count) {
+                m_hitters[min].sig = sig;
+                m_hitters[min].count = estimate;
+                m_hitters[min].key = key;
+            }
+            update_floor();
+            m_lock.unlock();
+        }
+
+        /*
+         * @brief : Scan the sizes of n buckets without their locks, the result is
+         *          a snapshot which may be a little stale. Buckets are any type
+         *          with size().
+         * */
+        template <typename _Bucket>
+        void scan(const _Bucket * buckets, uint32 n) {
+            uint32 histogram[HISTOGRAM_SIZE] = {0};
+            bucket_info top[TOP_BUCKETS];
+            memset(top, 0, sizeof(top));
+            uint32 entries = 0;
+
+            for (uint32 i = 0; i < n; ++i) {
+                uint32 length = buckets[i].size();
+                entries += length;
+                ++histogram[bin(length)];
+
+                // top is sorted by length, the shortest is the last
+                if (length <= top[TOP_BUCKETS - 1].length)
+                    continue;
+
+                uint32 pos = TOP_BUCKETS - 1;
+                while (pos > 0 && top[pos - 1].length < length) {
+                    top[pos] = top[pos - 1];
+                    --pos;
+                }
+                top[pos].index = i;
+                top[pos].length = length;
+            }
+
+            m_lock.lock();
+            memcpy(m_histogram, histogram, sizeof(m_histogram));
+            memcpy(m_top, top, sizeof(m_top));
+            m_entries = entries;
+            m_max_length = top[0].length;
+            ++m_scans;
+            m_lock.unlock();
+        }
+
+        // Halve all counts of the sketch and the heavy hitters
+        void age(void) {
+            m_lock.lock();
+            for (uint32 i = 0; i < SKETCH_DEPTH; ++i) {
+                for (uint32 j = 0; j < SKETCH_WIDTH; ++j)
+                    m_sketch[i][j] >>= 1;
+            }
+
+            for (uint32 i = 0; i < HEAVY_HITTERS; ++i)
+                m_hitters[i].count >>= 1;
+
+            update_floor();
+            m_lock.unlock();
+        }
+
+        // The longest chain found by the last scan
+        uint32 max_length(void) const {return m_max_length;}
+
+        /*
+         * @brief : Copy the heavy hitters to out, ordered by count. Return the
+         *          count of copied entries.
+         * */
+        uint32 heavy_hitters(hitter_info * out, uint32 max) {
+            hitter_info hitters[HEAVY_HITTERS];
+            m_lock.lock();
+            memcpy(hitters, m_hitters, sizeof(hitters));
+            m_lock.unlock();
+
+            // Sort the hitters in place, then copy the hottest ones
+            uint32 cnt = 0;
+            for (uint32 i = 0; i < HEAVY_HITTERS; ++i) {
+                if (hitters[i].count == 0)
+                    continue;
+
+                hitter_info hitter = hitters[i];
+                uint32 pos = cnt++;
+                while (pos > 0 && hitters[pos - 1].count < hitter.count) {
+                    hitters[pos] = hitters[pos - 1];
+                    --pos;
+                }
+
+                hitters[pos] = hitter;
+            }
+
+            if (cnt > max)
+                cnt = max;
+
+            for (uint32 i = 0; i < cnt; ++i)
+                out[i] = hitters[i];
+
+            return cnt;
+        }
+
+        // Print the report, keys are printed by operator<<
+        void str(ostream & os) {
+            os << "\nSkew Monitor : " << std::endl;
+            os << "** Scans   : " << m_scans << ", entries : " << m_entries
+               << ", longest chain : " << m_max_length << std::endl;
+
+            os << "** Chain length histogram : " << std::endl;
+            for (uint32 i = 0; i < HISTOGRAM_SIZE; ++i) {
+                uint32 low = (i == 0) ? 0 : (1U << (i - 1));
+                uint32 high = (i == 0) ? 0 : (low << 1) - 1;
+                os << "   " << low;
+                if (i == HISTOGRAM_SIZE - 1)
+                    os << "+";
+                else if (high > low)
+                    os << "-" << high;
+                os << " : " << m_histogram[i] << std::endl;
+            }
+
+            os << "** Longest buckets : " << std::endl;
+            for (uint32 i = 0; i < TOP_BUCKETS && m_top[i].length; ++i)
+                os << "   bucket " << m_top[i].index << " : " << m_top[i].length << std::endl;
+
+            hitter_info hitters[HEAVY_HITTERS];
+            uint32 cnt = heavy_hitters(hitters, HEAVY_HITTERS);
+            os << "** Heavy hitters of " << m_samples << " sampled lookups : " << std::endl;
+            for (uint32 i = 0; i < cnt; ++i)
+                os << "   " << hitters[i].key << " (sig " << hitters[i].sig << ") : " << hitters[i].count << std::endl;
+        }
+
+    private:
+        static uint32 bin(uint32 length) {
+            uint32 b = 0;
+            while (length && b < HISTOGRAM_SIZE - 1) {
+                length >>= 1;
+                ++b;
+            }
+
+            return b;
+        }
+
+        // Each row of the sketch mixes the signature by a different odd constant
+        static uint32 slot(uint32 row, sig_t sig) {
+            static const uint32 seeds[SKETCH_DEPTH] = {0x9E3779B1U, 0x85EBCA77U, 0xC2B2AE3DU, 0x27D4EB2FU};
+            return ((uint32)sig * seeds[row]) >> (32 - SKETCH_SHIFT);
+        }
+
+        // The smallest count of heavy hitters, samples below it are not kept
+        void update_floor(void) {
+            uint32 floor = (uint32)-1;
+            for (uint32 i = 0; i < HEAVY_HITTERS; ++i) {
+                if (m_hitters[i].count < floor)
+                    floor = m_hitters[i].count;
+            }
+
+            m_hitter_floor = floor;
+        }
+
+    private:
+        spinlock m_lock;            // guards the heavy hitters and the scan result
+        uint32   m_sample_mask;
+        volatile uint32 m_hitter_floor;
+        uint32   m_scans;
+        uint32   m_entries;
+        volatile uint32 m_max_length;
+        volatile uint32 m_samples;
+        uint32   m_histogram[HISTOGRAM_SIZE];
+        bucket_info m_top[TOP_BUCKETS];
+        hitter_info m_hitters[HEAVY_HITTERS];
+        uint32   m_sketch[SKETCH_DEPTH][SKETCH_WIDTH];  // updated by atomic adds
+};
+
+__SHM_STL_END
+
+#endif
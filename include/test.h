@@ -43,11 +43,24 @@ void init(_HashMap &hashmap) {
     if (rte_eal_process_type() != RTE_PROC_PRIMARY)
         return;
 
-    for (int i = 0; i < 1000; ++i) {
-        if (!hashmap.insert(i, i * i))
-            cout << "Insert <" << i << ", " << i * i << "> fail!" << endl;
+    // Insert by all slave lcores in parallel
+    const int n = 1000;
+    typename _HashMap::key_type keys[n];
+    typename _HashMap::value_type values[n];
+    for (int i = 0; i < n; ++i) {
+        keys[i] = i;
+        values[i] = i * i;
     }
 
+    u_int64_t mask = 0;
+    unsigned lcore;
+    RTE_LCORE_FOREACH_SLAVE(lcore)
+        mask |= 1ULL << lcore;
+
+    int inserted = hashmap.build_parallel(keys, values, n, mask);
+    if (inserted != n)
+        cout << "Insert " << n - inserted << " entries fail!" << endl;
+
     hashmap.print();
 }
 
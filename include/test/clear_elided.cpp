@@ -0,0 +1,73 @@
+/*
+ * Clear tables of 8 to 64 buckets whose bucket lock is elided_rwlock. clear()
+ * holds all bucket locks at once, more than RTM can elide, so some locks are
+ * taken and the rest are elided. A lock left held by clear() hangs the next
+ * insert, the alarm turns the hang into a failure.
+ *
+ * Build with -DSHM_STL_NO_DPDK, the table lives in a posix_alloc arena.
+ */
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+#include "shm_hash_map.h"
+
+using namespace std;
+using namespace shm_stl;
+
+typedef hash_map<uint32, uint32, shm_stl::hash<uint32>, std::equal_to<uint32>, posix_alloc, elided_rwlock> map_type;
+
+static void on_alarm(int) {
+    static const char msg[] = "FAIL : a bucket lock is left held by clear()\n";
+    ssize_t len = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)len;
+    _exit(1);
+}
+
+static bool clear_table(uint32 buckets) {
+    char name[16];
+    snprintf(name, sizeof(name), "clear_%u", buckets);
+
+    map_type table(name, buckets);
+    if (!table.create_or_attach())
+        return false;
+
+    const uint32 keys = buckets * 16;
+    for (uint32 round = 0; round < 3; ++round) {
+        for (uint32 k = 0; k < keys; ++k) {
+            if (!table.insert(k, k + round))
+                return false;
+        }
+
+        table.clear();
+        if (table.used_entries() != 0)
+            return false;
+
+        for (uint32 k = 0; k < keys; ++k) {
+            if (table.find(k))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+int main(void) {
+    if (!posix_alloc::init("clear_elided", SHM_PROC_PRIMARY, 64 << 20)) {
+        cout << "FAIL : can not create the arena" << endl;
+        return 1;
+    }
+
+    signal(SIGALRM, on_alarm);
+    alarm(30);
+
+    int ret = 0;
+    for (uint32 buckets = 8; buckets <= 64; buckets <<= 1) {
+        bool ok = clear_table(buckets);
+        cout << (ok ? "PASS" : "FAIL") << " : clear a table of " << buckets << " buckets" << endl;
+        if (!ok)
+            ret = 1;
+    }
+
+    posix_alloc::fini();
+    return ret;
+}
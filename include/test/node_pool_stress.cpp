@@ -0,0 +1,214 @@
+/*
+ * Get and put nodes of one NodePool on several threads while shrink() and
+ * reset() run on the main thread. Every holder marks its nodes and checks the
+ * marks before it puts them back, a node handed out twice gets the mark of
+ * another holder. At the end all nodes are free and distinct.
+ *
+ * A reset() drops the nodes in use, as clear() does under the bucket lock. So
+ * the threads using get_node() and get_nodes() hold their own lock while they
+ * hold nodes, and reset() takes all of these locks. A thread using
+ * reserve_node() takes no lock, its nodes are only checked while no reset()
+ * has freed them. A reset() would also make up for a node put twice, so the
+ * resets stop when the workers are halfway, and the counts are checked after
+ * a run of get and put with shrink() only.
+ *
+ * Build with -DSHM_STL_NO_DPDK, the pool lives in a posix_alloc arena.
+ */
+#include <iostream>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include "shm_node_pool.h"
+
+using namespace std;
+using namespace shm_stl;
+
+typedef Node<uint32, uint32> node_type;
+typedef NodePool<node_type, posix_alloc> pool_type;
+
+static const uint32 WORKERS = 3;
+static const uint32 ROUNDS = 20000;
+static const uint32 MAX_BATCH = 64;
+
+static pool_type * pool;
+static pthread_mutex_t holding[WORKERS];
+static volatile uint32 running;
+static volatile uint32 halfway;
+static volatile int failed;
+
+static void on_alarm(int) {
+    static const char msg[] = "FAIL : the pool hangs\n";
+    ssize_t len = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)len;
+    _exit(1);
+}
+
+static void mark(node_type ** nodes, uint32 n, uint32 owner, uint32 round) {
+    for (uint32 i = 0; i < n; ++i)
+        nodes[i]->fill(owner, round, i);
+}
+
+static bool marked(node_type ** nodes, uint32 n, uint32 owner, uint32 round) {
+    for (uint32 i = 0; i < n; ++i) {
+        if (nodes[i]->key() != owner || nodes[i]->value() != round || nodes[i]->signature() != i)
+            return false;
+    }
+
+    return true;
+}
+
+// Get nodes one by one or in a batch, and put them back one by one or in a batch
+static void * worker(void * arg) {
+    const uint32 id = (uint32)(long)arg;
+    node_type * held[MAX_BATCH];
+
+    for (uint32 round = 0; round < ROUNDS && !failed; ++round) {
+        if (round == ROUNDS / 2)
+            __sync_fetch_and_add(&halfway, 1);
+
+        // A large batch now and then grows the pool, so shrink() has lists to release
+        uint32 n = (round % 64 == id) ? MAX_BATCH : round % 7 + 1;
+
+        pthread_mutex_lock(&holding[id]);
+        uint32 got = 0;
+        if (round & 1) {
+            got = pool->get_nodes(n, held);
+        } else {
+            while (got < n && (held[got] = pool->get_node()) != NULL)
+                ++got;
+        }
+
+        mark(held, got, id, round);
+        if (round % 5 == 0)
+            sched_yield();
+        if (!marked(held, got, id, round))
+            failed = 1;
+
+        if (round % 3) {
+            pool->put_nodes(got, held);
+        } else {
+            for (uint32 i = 0; i < got; ++i)
+                pool->put_node(held[i]);
+        }
+        pthread_mutex_unlock(&holding[id]);
+        sched_yield();
+    }
+
+    __sync_fetch_and_sub(&running, 1);
+    return NULL;
+}
+
+// Reserve nodes without a lock, a reset() may free them meanwhile
+static void * reserver(void *) {
+    const uint32 id = WORKERS;
+
+    for (uint32 round = 0; running && !failed; ++round) {
+        uint32 stamp;
+        node_type * node = pool->reserve_node(&stamp);
+        if (node == NULL) {
+            failed = 1;
+            break;
+        }
+
+        mark(&node, 1, id, round);
+        sched_yield();
+        if (!marked(&node, 1, id, round) && pool->resets() == stamp)
+            failed = 1;
+
+        pool->unreserve_node(node, stamp);
+    }
+
+    return NULL;
+}
+
+// No node is free twice: all free nodes can be got at once and are distinct
+static bool distinct_free_nodes(void) {
+    const uint32 cap = pool->capacity();
+    node_type ** all = new node_type *[cap];
+    bool ok = pool->get_nodes(cap, all) == cap && pool->free_entries() == 0;
+
+    for (uint32 i = 0; ok && i < cap; ++i)
+        all[i]->fill(0, i, 0);
+    for (uint32 i = 0; ok && i < cap; ++i)
+        ok = all[i]->value() == i;
+
+    pool->put_nodes(cap, all);
+    delete [] all;
+    return ok && pool->free_entries() == cap;
+}
+
+static int stress_pool(void) {
+    void * mem = posix_alloc::zmalloc("node_pool_stress", sizeof(pool_type), SHM_CACHE_LINE_SIZE);
+    if (mem == NULL) {
+        cout << "FAIL : can not allocate the pool" << endl;
+        return 1;
+    }
+    pool = new (mem) pool_type(16);
+
+    for (uint32 i = 0; i < WORKERS; ++i)
+        pthread_mutex_init(&holding[i], NULL);
+
+    running = WORKERS;
+    pthread_t threads[WORKERS + 1];
+    for (uint32 i = 0; i < WORKERS; ++i)
+        pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+    pthread_create(&threads[WORKERS], NULL, reserver, NULL);
+
+    uint32 shrunk = 0;
+    uint32 resets = 0;
+    for (uint32 i = 0; running; ++i) {
+        shrunk += pool->shrink();
+
+        if (halfway == 0 && i % 8 == 0) {
+            for (uint32 w = 0; w < WORKERS; ++w)
+                pthread_mutex_lock(&holding[w]);
+            pool->reset();
+            ++resets;
+            for (uint32 w = 0; w < WORKERS; ++w)
+                pthread_mutex_unlock(&holding[w]);
+        }
+        sched_yield();
+    }
+
+    for (uint32 i = 0; i <= WORKERS; ++i)
+        pthread_join(threads[i], NULL);
+
+    int ret = 0;
+    bool ok = !failed;
+    cout << (ok ? "PASS" : "FAIL") << " : no node is handed out twice during "
+         << resets << " resets, " << shrunk << " nodes released by shrink()" << endl;
+    if (!ok)
+        ret = 1;
+
+    ok = pool->free_entries() == pool->capacity();
+    cout << (ok ? "PASS" : "FAIL") << " : " << pool->free_entries() << " free of "
+         << pool->capacity() << " nodes" << endl;
+    if (!ok)
+        ret = 1;
+
+    ok = distinct_free_nodes();
+    cout << (ok ? "PASS" : "FAIL") << " : all free nodes are distinct" << endl;
+    if (!ok)
+        ret = 1;
+
+    pool->~pool_type();
+    posix_alloc::free(mem);
+    return ret;
+}
+
+int main(void) {
+    if (!posix_alloc::init("node_pool_stress", SHM_PROC_PRIMARY, 64 << 20)) {
+        cout << "FAIL : can not create the arena" << endl;
+        return 1;
+    }
+
+    signal(SIGALRM, on_alarm);
+    alarm(60);
+
+    int ret = stress_pool();
+
+    posix_alloc::fini();
+    return ret;
+}
@@ -0,0 +1,149 @@
+/*
+ * Reseed a table to completion while other threads look up, insert and erase.
+ * Lookups of keys which are never erased must always hit. After the reseeds
+ * each of those keys is found exactly once: it is found, erased, and not found
+ * any more. The count of entries does not change across reseeds.
+ *
+ * Build with -DSHM_STL_NO_DPDK, the table lives in a posix_alloc arena.
+ */
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include "shm_hash_map.h"
+
+using namespace std;
+using namespace shm_stl;
+
+typedef hash_map<uint32, uint32, shm_stl::hash<uint32>, std::equal_to<uint32>, posix_alloc> map_type;
+
+static const uint32 BUCKETS = 64;
+static const uint32 STABLE_KEYS = 4096;
+static const uint32 STABLE_BASE = 1u << 24;
+static const uint32 WORKER_KEYS = 256;
+static const uint32 WORKERS = 3;
+static const uint32 RESEEDS = 16;
+
+static map_type * table;
+static volatile int stop;
+static volatile int failed;
+
+static void on_alarm(int) {
+    static const char msg[] = "FAIL : a reseed does not complete\n";
+    ssize_t len = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)len;
+    _exit(1);
+}
+
+// Lookups of stable keys, inserts and erases of keys owned by this worker
+static void * worker(void * arg) {
+    const uint32 base = (uint32)(long)arg * WORKER_KEYS;
+    uint32 next = 0;
+
+    while (!stop && !failed) {
+        for (uint32 k = base; k < base + WORKER_KEYS; ++k) {
+            if (!table->insert(k, k))
+                failed = 1;
+        }
+
+        for (uint32 i = 0; i < WORKER_KEYS; ++i, ++next) {
+            uint32 key = STABLE_BASE + next % STABLE_KEYS;
+            uint32 value;
+            if (!table->find(key, &value) || value != key)
+                failed = 1;
+        }
+
+        for (uint32 k = base; k < base + WORKER_KEYS; ++k) {
+            uint32 value;
+            if (!table->erase(k, &value) || value != k)
+                failed = 1;
+            if (table->find(k))
+                failed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Every stable key is found once, an entry left behind by a reseed is found again
+static bool found_once(void) {
+    for (uint32 k = STABLE_BASE; k < STABLE_BASE + STABLE_KEYS; ++k) {
+        uint32 value;
+        if (!table->find(k, &value) || value != k)
+            return false;
+        if (!table->erase(k) || table->find(k))
+            return false;
+        if (!table->insert(k, k))
+            return false;
+    }
+
+    return true;
+}
+
+static int reseed_table(void) {
+    map_type map("reseed", BUCKETS);
+    if (!map.create_or_attach()) {
+        cout << "FAIL : can not create the table" << endl;
+        return 1;
+    }
+    table = &map;
+
+    for (uint32 k = STABLE_BASE; k < STABLE_BASE + STABLE_KEYS; ++k)
+        map.insert(k, k);
+    const uint32 used = map.used_entries();
+    map.enable_reseed(STABLE_KEYS);
+
+    pthread_t threads[WORKERS];
+    for (uint32 i = 0; i < WORKERS; ++i)
+        pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+
+    bool reseeded = true;
+    for (uint32 round = 0; round < RESEEDS && !failed; ++round) {
+        if (!map.reseed()) {
+            reseeded = false;
+            break;
+        }
+        while (map.reseeding()) {
+            map.rebalance(32);
+            sched_yield();
+        }
+    }
+
+    stop = 1;
+    for (uint32 i = 0; i < WORKERS; ++i)
+        pthread_join(threads[i], NULL);
+
+    int ret = 0;
+    bool ok = reseeded && !failed;
+    cout << (ok ? "PASS" : "FAIL") << " : look up, insert and erase during " << RESEEDS << " reseeds" << endl;
+    if (!ok)
+        ret = 1;
+
+    ok = map.used_entries() == used;
+    cout << (ok ? "PASS" : "FAIL") << " : " << used << " entries are kept by the reseeds" << endl;
+    if (!ok)
+        ret = 1;
+
+    ok = found_once();
+    cout << (ok ? "PASS" : "FAIL") << " : every key is found exactly once" << endl;
+    if (!ok)
+        ret = 1;
+
+    return ret;
+}
+
+int main(void) {
+    if (!posix_alloc::init("reseed_concurrent", SHM_PROC_PRIMARY, 64 << 20)) {
+        cout << "FAIL : can not create the arena" << endl;
+        return 1;
+    }
+
+    signal(SIGALRM, on_alarm);
+    alarm(60);
+
+    int ret = reseed_table();
+
+    posix_alloc::fini();
+    return ret;
+}